@@ -0,0 +1,213 @@
+/* See LICENSE file for copyright and license details. */
+
+/* Benchmark for the paths of ocrond that don't run in a steady state:
+ * reloading the crontab, a forward clock jump that makes every job due at once,
+ * and a backward clock jump that makes ocrond schedule all jobs from scratch.
+ *
+ * usage: ocrond-bench [lines ...]
+ *
+ * For crontabs of each given number of lines, it prints the wall time, the CPU time
+ * and the page faults and context switches of each scenario, as a rough measure
+ * of the system calls made, and how many lines would have been logged. */
+
+#include <sys/resource.h>
+#include <syslog.h>
+
+/* Count the log lines instead of sending them. */
+static unsigned long logLines;
+
+static void
+count_syslog(int priority, const char *fmt, ...)
+{
+	(void) priority;
+	(void) fmt;
+	++logLines;
+}
+
+#define syslog count_syslog
+#define main ocrond_main
+#include "ocrond.c"
+#undef main
+
+/* How far the clock jumps, in seconds. Far enough for every job to come due,
+ * and for almost all of them to be skipped instead of started. */
+#define JUMP (2 * 86400)
+
+struct Sample
+{
+	struct timespec wall;
+	struct rusage usage;
+	unsigned long lines;
+	unsigned long started;
+};
+
+/* The kinds of crontab lines, from jobs that fire every few minutes to ones
+ * that fire a couple of times a year. They take a minute and an hour. */
+static const char *shapes[] = {
+	"*/5 * * * *",
+	"%d * * * *",
+	"%d */2 * * *",
+	"%d %d * * *",
+	"%d %d * * Mon-Fri",
+	"%d %d 1 * *",
+	"%d %d L * *",
+	"%d %d 15W * *",
+	"%d %d * * Tue#2",
+	"%d %d * Jan,Jul *",
+};
+
+static unsigned long seed = 1;
+
+static int
+random_below(int n)
+{
+	seed = seed * 1103515245 + 12345;
+	return (seed >> 16) % n;
+}
+
+/* Write a crontab of num lines to path. */
+static void
+write_crontab(const char *path, int num)
+{
+	FILE *file;
+	int line;
+
+	if ((file = fopen(path, "w")) == NULL) {
+		perror(path);
+		exit(1);
+	}
+	seed = 1;
+	for (line = 0; line < num; ++line) {
+		fprintf(file, shapes[random_below(sizeof(shapes) / sizeof(shapes[0]))],
+			random_below(60), random_below(24));
+		if (line % 7 == 0) fprintf(file, " @group=g%d", line / 7 % 16);
+		if (line % 13 == 0) fprintf(file, " @priority=%d", line % 199 - 99);
+		fprintf(file, " true\n");
+	}
+	fclose(file);
+}
+
+static void
+begin_sample(struct Sample *sample)
+{
+	sample->lines = logLines;
+	sample->started = STATS(0).started;
+	getrusage(RUSAGE_SELF, &sample->usage);
+	clock_gettime(CLOCK_MONOTONIC, &sample->wall);
+}
+
+static double
+millis(const struct timeval *a, const struct timeval *b)
+{
+	return (b->tv_sec - a->tv_sec) * 1e3 + (b->tv_usec - a->tv_usec) / 1e3;
+}
+
+static void
+end_sample(const char *scenario, int num, const struct Sample *sample)
+{
+	struct timespec wall;
+	struct rusage usage;
+
+	clock_gettime(CLOCK_MONOTONIC, &wall);
+	getrusage(RUSAGE_SELF, &usage);
+	printf("%-10s %8d %10.1f %10.1f %10.1f %10ld %8ld %10lu %8lu\n", scenario, num,
+		seconds_between(&sample->wall, &wall) * 1e3,
+		millis(&sample->usage.ru_utime, &usage.ru_utime),
+		millis(&sample->usage.ru_stime, &usage.ru_stime),
+		usage.ru_minflt - sample->usage.ru_minflt,
+		(usage.ru_nvcsw + usage.ru_nivcsw) - (sample->usage.ru_nvcsw + sample->usage.ru_nivcsw),
+		logLines - sample->lines, STATS(0).started - sample->started);
+}
+
+/* What the main loop does when it receives a SIGHUP. */
+static void
+bench_reload(int num)
+{
+	struct Sample sample;
+
+	begin_sample(&sample);
+	syslog(LOG_NOTICE, "Reloading %s because we received a SIGHUP.", crontabPath);
+	free_jobs();
+	load_jobs();
+	restart_jobs(current_time());
+	next_job();
+	end_sample("reload", num, &sample);
+}
+
+/* What the main loop does when it wakes up to find that the clock was set
+ * forward: dispatch until nothing is due anymore. */
+static void
+bench_forward(int num)
+{
+	struct Sample sample;
+	time_t now, wake;
+	int next;
+
+	restart_jobs(current_time() - JUMP);
+	next = next_job();
+
+	begin_sample(&sample);
+	now = current_time();
+	for (;;) {
+		wake = agenda_wake();
+		if (next >= 0 && (wake == NEVER || wake_time(next) < wake)) wake = wake_time(next);
+		if (wake == NEVER || wake > now) break;
+		dispatch(now, next >= 0 && due_time(next) <= now);
+		next = next_job();
+	}
+	end_sample("forward", num, &sample);
+}
+
+/* What the main loop does when it notices that the clock was set back. */
+static void
+bench_backward(int num)
+{
+	struct Sample sample;
+
+	restart_jobs(current_time() + JUMP);
+	next_job();
+
+	begin_sample(&sample);
+	syslog(LOG_NOTICE, "Detected that the system time was set back. Recalculating.");
+	restart_jobs(current_time());
+	next_job();
+	end_sample("backward", num, &sample);
+}
+
+int
+main(int argc, char *argv[])
+{
+	static int defaults[] = { 1000, 10000, 100000 };
+	char path[] = TEMPFILE;
+	int i, fd, num;
+
+	if ((fd = mkstemp(path)) < 0) {
+		perror("mkstemp");
+		return 1;
+	}
+	close(fd);
+	crontabPath = path;
+	spoolDir = "/nonexistent";
+
+	if (posix_memalign((void **) &stats, CACHELINE, (SHARDS) * sizeof(stats[0]))) {
+		die("Out of memory.");
+	}
+	memset(stats, 0, (SHARDS) * sizeof(stats[0]));
+
+	printf("%-10s %8s %10s %10s %10s %10s %8s %10s %8s\n", "scenario", "lines",
+		"wall ms", "user ms", "sys ms", "faults", "ctxsw", "logged", "started");
+	for (i = 0; i < (argc > 1 ? argc - 1 : 3); ++i) {
+		num = argc > 1 ? atoi(argv[i + 1]) : defaults[i];
+		write_crontab(path, num);
+		load_jobs();
+		bench_reload(num);
+		bench_forward(num);
+		bench_backward(num);
+		free_jobs();
+		/* Collect the few jobs that were due recently enough to be started. */
+		while (wait(NULL) > 0);
+	}
+
+	unlink(path);
+	return 0;
+}
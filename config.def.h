@@ -2,8 +2,12 @@
 
 /* The file that contains the cron rules. */
 #define CRONTAB       "/etc/crontab"
+/* The directory that holds the crontabs of the individual users, each named after its user. */
+#define SPOOLDIR      "/var/spool/cron/crontabs"
 /* The shell that should be executed to run a command. */
 #define SHELL         "/bin/sh"
+/* Template for the temporary files that ocrond uses to pass data to and from jobs. */
+#define TEMPFILE      "/tmp/ocrond.XXXXXX"
 /* The name that should be used to refer to ocrond in the system log. */
 #define LOGIDENT      "crond"
 
@@ -12,8 +16,39 @@
  * If your system clock never changes, or your jobs run frequently enough and don't need
  * precision, you can safely make this value as large as you want. */
 #define WAKEUP_PERIOD 60
+/* If ocrond is about to sleep for at least this many minutes, it first hands the memory
+ * it won't need until then back to the system. 0 disables this. */
+#define IDLE_TRIM     10
+/* How many seconds ahead of time the processes of jobs marked with @prespawn are spawned. */
+#define PRESPAWN_LEAD 2
+/* Jobs deferred to the end of a blackout window are spread over this many minutes
+ * after it, by line number, so that they don't all start at once. */
+#define DEFER_SPREAD  0
+/* While a job with at least this @priority runs, all other running jobs are stopped,
+ * so that the urgent job gets the machine to itself. 100 disables this.
+ * Only the system crontab may use such priorities. */
+#define PREEMPT_PRIORITY 50
+/* When several instances coordinate through a lock directory, how many seconds
+ * an instance waits for the owner of a job to execute it before trying itself. */
+#define LOCK_GRACE    5
+/* Jobs that fire at least this many times a day are scheduled through an agenda that
+ * lists all their executions in the next 24 hours, so that dispatching them costs next
+ * to nothing. All other jobs are scheduled one execution at a time. 0 disables the agenda. */
+#define AGENDA_MIN_FIRES 24
 /* How many minutes a scheduled job may lie in the past before it gets skipped. */
 #define CATCHUP_LIMIT 60
+/* Into how many shards the job queue is split. Each shard only has to be searched again
+ * when one of its jobs changed, and recalculating all jobs after a reload or a clock
+ * change uses one thread per shard. Values around the number of cores, or around the
+ * square root of the number of jobs, work well for very large crontabs. */
+#define SHARDS        1
+/* The SCHED_FIFO priority of the dispatch loop when ocrond is started with -R,
+ * and the nice value it falls back to if SCHED_FIFO isn't available. */
+#define RT_PRIORITY   10
+#define RT_NICE       -15
+/* After how many seconds a watchdog thread reports that the main loop is stuck
+ * (for example in a blocking syslog() call), delaying all due jobs. 0 disables it. */
+#define STALL_THRESHOLD 5
 /* The maximum amount of days that ocron may look into the future to schedule a job.
  * Should ocron be unable to schedule the job within this time frame, the job is
  * considered to be unable to execute and subsequently gets permanently disabled. */
@@ -8,6 +8,7 @@ LD = cc
 # NOTE GCC with -pedantic gives false positive warnings about syslog().
 CFLAGS = -Os -Wall -Wextra
 LDFLAGS = -Os
+LIBS = -lpthread
 
 # installation paths
 PREFIX = /usr/local
@@ -1,50 +1,258 @@
 /* See LICENSE file for copyright and license details. */
 
 /* Mostly Posix.1-2008 compatible, but also relies on the following extensions:
- * reallocarray(3), ffsl(3), ffsll(3). */
+ * reallocarray(3), ffsl(3), ffsll(3), initgroups(3), madvise(2). */
 
 #include <assert.h>
 #include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <grp.h>
+#include <limits.h>
+#include <pthread.h>
+#include <pwd.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 #include <syslog.h>
 #include <time.h>
 #include <unistd.h>
 
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
 #include "config.h"
 
 #define VERSION "0.13"
 
+#ifndef _PATH_LOG
+#define _PATH_LOG "/dev/log"
+#endif
+
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
 
 #define VALID_HOUR(job, hour) ((job).hours >> (hour) & 1)
 #define VALID_MDAY(job, mday) ((job).mdays >> (mday) & 1)
 #define VALID_WDAY(job, wday) ((job).wdays >> (wday) & 1)
 #define VALID_DAY(job, mday, wday) (VALID_MDAY(job, mday) || VALID_WDAY(job, wday))
 #define VALID_MONTH(job, month) ((job).months >> (month) & 1)
-#define VALID_DATE(job, mday, wday, month) (VALID_DAY(job, mday, wday) && VALID_MONTH(job, month))
+#define VALID_NTH_WDAY(job, nth, wday) ((job).nthwdays >> (7 * (nth) + (wday)) & 1)
+#define LAST_NTH 5
+
+#define MAX_BLACKOUTS 32
+
+/* Marks a job that can't be scheduled anymore. */
+#define NEVER ((time_t) -1)
+/* The bits of Job.minutes and Job.hours that stand for actual minutes and hours. */
+#define MINUTE_BITS ((1ULL << 60) - 1)
+#define HOUR_BITS ((1UL << 24) - 1)
+
+/* How far ahead the agenda reaches, and how much of it may be used up before it gets extended. */
+#define AGENDA_SPAN (24 * 60 * 60)
+#define AGENDA_STEP (60 * 60)
+
+/* How far a DST switch may move local midnight away from where 24-hour days would put it. */
+#define DST_SLACK (2 * 60 * 60)
+
+/* How many jobs each shard should have at least before a restart uses threads. */
+#define MIN_THREADED_SHARD 256
+/* How much stack is faulted in ahead of time in real-time mode. */
+#define RT_STACK (64 * 1024)
+/* How much stack the watchdog and restart threads get. */
+#define THREAD_STACK (64 * 1024)
+
+/* Keeps the compiler from inlining a function into its callers. */
+#ifdef __GNUC__
+#define NOINLINE __attribute__((noinline))
+#else
+#define NOINLINE
+#endif
 
 #define JOBREACHED -2
+#define PRESPAWNREACHED -3
+
+/* What the main loop is busy with, as seen by the watchdog. */
+#define PHASE_WAITING     0
+#define PHASE_DISPATCHING 1
+#define PHASE_REAPING     2
+#define PHASE_RELOADING   3
+#define NUM_PHASES        4
+/* The watchdog logs at most one stall per this many seconds. */
+#define STALL_LOG_PERIOD 60
+
+/* Statistics are kept per thread, each on cache lines of their own. */
+#define CACHELINE 64
+/* Bucket 0 counts jobs started less than a millisecond after they came due,
+ * bucket n those started within 2^n milliseconds, the last one all later ones. */
+#define LATENCY_BUCKETS 16
+#define STATS(slot) (stats[slot].s)
+
+/* How many words a command may have to be executed without a shell. */
+#define MAX_DIRECT_ARGS 32
+
+/* The range of @priority values. */
+#define MAX_PRIORITY 99
+/* Whether a job pauses the other jobs running besides it. */
+#define URGENT(job) ((job).priority >= (PREEMPT_PRIORITY))
+
+/* Values of Job.prespawn besides 0. */
+#define PRESPAWN_WANTED 1
+#define PRESPAWN_FAILED 2
+
+/* The shell code that ends every batch script, and an upper bound on
+ * how much shell code a batch script needs around each command.
+ * Quoting a command can make it up to BATCH_QUOTING times as long. */
+#define BATCH_TRAILER "wait\n"
+#define BATCH_OVERHEAD 64
+#define BATCH_QUOTING 4
+
+/* Whether a job can run as part of a batch. Batched jobs share the stdin of their
+ * shell, and pre-spawned jobs already have a process of their own. */
+#define BATCHABLE(job) ((job).group && !(job).feed && (job).gate < 0)
+
+/* Whether a job stands for the process it runs in. Each process has exactly one such job:
+ * a job started on its own, or the member of a batch in slot 0. */
+#define LEADS_PROCESS(job) ((job).pid && ((job).statusfd < 0 || !(job).slot))
 
 struct Job
 {
 	long long minutes;
 	time_t time;
+	/* Commands from the spool are only loaded while they are needed,
+	 * and are NULL otherwise. See load_command(). */
 	char *command;
+	/* The text that is passed to the command's stdin, or NULL.
+	 * Points into the same allocation as command. */
+	char *payload;
+	/* Where the command's text can be found in its crontab. */
+	off_t cmdoff;
+	size_t cmdlen;
+	/* NUL-separated list of input paths, terminated by an empty string. */
+	char *inputs;
+	/* Newest input modification time seen when the job was last launched,
+	 * and the one seen when the job last returned successfully. */
+	struct timespec seen;
+	struct timespec done;
 	long hours;
+	/* Bit 0 stands for the last day of the month. */
 	long mdays;
+	/* Days whose nearest weekday is valid. Bit 0 stands for the last weekday of the month. */
+	long wmdays;
+	/* Bit 7 * n + wday stands for the (n + 1)-th such week-day of the month,
+	 * and bit 7 * LAST_NTH + wday for the last one. */
+	long long nthwdays;
+	/* The blackout windows that the job avoids, one bit per window. */
+	unsigned long defer;
+	/* Identifies the job across ocrond instances that share a crontab. */
+	unsigned long long hash;
+	/* When the job was last started on its own, or 0,
+	 * and a moving average of how many seconds it took so far. */
+	time_t started;
+	float runtime;
 	pid_t pid;
+	/* The status file of the batch that the job currently runs in, or -1. */
+	int statusfd;
+	/* The pipe that releases the job's pre-spawned process, or -1. */
+	int gate;
+	/* How many seconds after its time the job is dispatched.
+	 * Gives the instance that owns the job a head start. */
+	int delay;
+	/* The crontab that the job comes from, as an index into crontabs. */
+	int file;
 	short months;
 	short wdays;
 	short lineno;
+	/* The batch group of the job (as an index into groups, plus one), or 0. */
+	short group;
+	/* The position of the job within the batch it currently runs in. */
+	short slot;
+	/* Whether the job runs in the background of its batch. */
+	char background;
+	/* Whether the process that the job runs in was stopped to make way for urgent jobs. */
+	char paused;
+	/* Jobs with a higher priority are started first when several come due together. */
+	signed char priority;
+	/* Whether the job is scheduled through the agenda rather than the queue. */
+	char frequent;
+	/* Whether the job has been taken from the agenda by the current dispatch already. */
+	char picked;
+	/* Whether time is only a lower bound, which still has to be resolved
+	 * into the first execution after the last restart. See next_job(). */
+	char lazy;
+	/* Whether the job's process should be spawned ahead of time. */
+	char prespawn;
+	/* Whether the command has text for its stdin. */
+	char feed;
+};
+
+/* A crontab file. All but the first one belong to a user from the spool. */
+struct Crontab
+{
+	char *path;
+	char *user;
+	char *home;
+	/* Which file was loaded, and when it was modified before that. */
+	struct timespec mtime;
+	ino_t ino;
+	/* The last dispatch at which the file was found unchanged. */
+	time_t checked;
+	uid_t uid;
+	gid_t gid;
+};
+
+/* An upcoming execution of a job on the agenda. */
+struct Fire
+{
+	time_t due;
+	int job;
+};
+
+/* A weekly recurring period of time in which deferrable jobs must not run. */
+struct Blackout
+{
+	char *name;
+	/* Begin and end as minutes since midnight.
+	 * If end isn't after begin, the window extends into the next day. */
+	short begin;
+	short end;
+	short wdays;
+};
+
+/* Counters that are only ever updated by a single thread, and summed up when read. */
+struct Stats
+{
+	unsigned long started;
+	unsigned long batches;
+	unsigned long prespawned;
+	unsigned long failed;
+	unsigned long late;
+	unsigned long running;
+	unsigned long unchanged;
+	unsigned long claimed;
+	unsigned long scheduled;
+	unsigned long paused;
+	unsigned long latency[LATENCY_BUCKETS];
+};
+
+union StatsSlot
+{
+	struct Stats s;
+	char pad[(sizeof(struct Stats) + CACHELINE - 1) / CACHELINE * CACHELINE];
 };
 
 static const char *no_aliases[] = { NULL };
@@ -57,11 +265,103 @@ static const char *wdays_aliases[] = {
 	"Thu", "Fri", "Sat", NULL
 };
 
+/* Shell builtins and keywords. Commands that start with one of these always go through
+ * the shell, even where a program of the same name exists, since the two can differ. */
+static const char *shell_builtins[] = {
+	".", ":", "alias", "bg", "break", "cd", "command", "continue", "echo", "eval",
+	"exec", "exit", "export", "false", "fc", "fg", "getopts", "hash", "jobs", "kill",
+	"local", "printf", "pwd", "read", "readonly", "return", "set", "shift", "test",
+	"time", "times", "trap", "true", "type", "ulimit", "umask", "unalias", "unset", "wait",
+	"case", "do", "done", "elif", "else", "esac", "fi", "for", "if", "in", "then",
+	"until", "while", NULL
+};
+
 /* A queue containing all jobs. Implemented as a simple unordered array. */
 static int capJobs;
 static int numJobs;
 static struct Job *jobs;
 
+/* The queue is split into shards of shardLen consecutive jobs.
+ * Each shard remembers its closest job, and only has to be scanned again
+ * once one of its jobs was touched. */
+static int shardLen = 1;
+static int shardNext[SHARDS];
+static char shardDirty[SHARDS];
+
+/* All blackout windows, in the order in which they were defined. */
+static int numBlackouts;
+static struct Blackout *blackouts;
+
+/* The agenda: all executions of the frequent jobs up to windowEnd, sorted by due time.
+ * Executions before agendaNext have already been dispatched. */
+static int numFrequent;
+static int agendaCap;
+static int agendaLen;
+static int agendaNext;
+static struct Fire *agenda;
+static time_t windowEnd;
+/* Room for the next execution of every frequent job while the agenda gets extended. */
+static struct Fire *pending;
+
+/* The local time of the last restart, which lazy jobs get scheduled from. */
+static struct tm restartTm;
+
+/* The names of all batch groups. */
+static int numGroups;
+static char **groups;
+
+/* Scratch space for dispatching jobs, allocated once the crontab is loaded.
+ * batch and dueJobs can hold numJobs ints, script can hold the shell script of any batch. */
+static int *batch;
+static int *dueJobs;
+static char *script;
+static size_t scriptSize;
+
+/* The system crontab, followed by the crontabs in the spool. */
+static int numCrontabs;
+static struct Crontab *crontabs;
+
+/* Scratch space for loading a command from the spool. */
+static char *cmdbuf;
+static size_t cmdbufSize;
+
+/* Where the crontabs are read from. Only the benchmark points these elsewhere. */
+static const char *crontabPath = CRONTAB;
+static const char *spoolDir = SPOOLDIR;
+
+/* The directory through which ocrond instances coordinate, or NULL. */
+static const char *lockDir;
+/* Which of how many coordinating instances this one is. */
+static unsigned instance;
+static unsigned numInstances = 1;
+
+/* Whether the dispatch loop runs with real-time priority and locked memory. */
+static int realtime;
+
+/* How many urgent jobs are running, keeping the other jobs paused. */
+static int numUrgent;
+
+static const char *phaseNames[NUM_PHASES] = { "waiting", "dispatching", "reaping", "reloading" };
+/* The heartbeat of the main loop: it bumps beat whenever it enters a new phase. */
+static pthread_mutex_t watchLock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long beat;
+static int phase;
+static struct timespec phaseBegin;
+/* One slot of statistics per shard. The thread that recalculates a shard uses its slot,
+ * and the main loop uses slot 0. */
+static union StatsSlot *stats;
+
+/* The watchdog's own connection to the system logger, or -1. */
+static int watchSocket = -1;
+
+/* How often and for how long at most the main loop stalled in each phase. */
+static unsigned long stalls[NUM_PHASES];
+static double longestStall[NUM_PHASES];
+
+/* The crontab that we currently parse, and its contents.
+ * Only used at startup. */
+static int parseFile;
+static char *parseContents;
 /* A pointer to the character that is currently examined
  * by the crontab parser. Only used at startup. */
 static char *text;
@@ -89,6 +389,84 @@ readall(int fd, void *buf, size_t count)
 	return 0;
 }
 
+/* Similar to write(2), but automatically restarts if less than count
+ * bytes were written or if EINTR occurred. */
+static int
+writeall(int fd, const void *buf, size_t count)
+{
+	ssize_t ret;
+	while (count > 0) {
+		ret = write(fd, buf, count);
+		if (ret < 0) {
+			if (errno != EINTR) return -1;
+			ret = 0;
+		}
+		buf += ret, count -= ret;
+	}
+	return 0;
+}
+
+/* The 64-bit FNV-1a hash of a string of len characters, continued from hash. */
+static unsigned long long
+fnv1a(unsigned long long hash, const char *str, size_t len)
+{
+	while (len--) {
+		hash ^= (unsigned char) *str++;
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+/* How many bits are set in bits. */
+static int
+count_bits(unsigned long long bits)
+{
+	int num = 0;
+
+	for (; bits; bits &= bits - 1) ++num;
+	return num;
+}
+
+static void
+swap_bytes(char *a, char *b, size_t size)
+{
+	char tmp;
+
+	while (size--) {
+		tmp = *a;
+		*a++ = *b;
+		*b++ = tmp;
+	}
+}
+
+static void
+sift_down(char *base, size_t root, size_t num, size_t size, int (*compar)(const void *, const void *))
+{
+	size_t child;
+
+	while ((child = 2 * root + 1) < num) {
+		if (child + 1 < num && compar(base + child * size, base + (child + 1) * size) < 0) ++child;
+		if (compar(base + root * size, base + child * size) >= 0) return;
+		swap_bytes(base + root * size, base + child * size, size);
+		root = child;
+	}
+}
+
+/* Like qsort(3), but never allocates memory, which glibc's qsort() does
+ * for all but the smallest arrays. It's a plain heapsort. */
+static void
+sort_in_place(void *base, size_t num, size_t size, int (*compar)(const void *, const void *))
+{
+	char *bytes = base;
+	size_t i;
+
+	for (i = num / 2; i-- > 0;) sift_down(bytes, i, num, size, compar);
+	for (i = num; i-- > 1;) {
+		swap_bytes(bytes, bytes + i * size, size);
+		sift_down(bytes, 0, i, size, compar);
+	}
+}
+
 /* Just like glibc's strchrnul(3), but portable.
  * Essentially, it behaves just like strchr(3), but it will
  * also return any NUL characters encountered along the way. */
@@ -117,6 +495,39 @@ days_in_month(int month, int year)
 	return month != 1 ? 30 + ((month % 7 + 1) & 1) : 28 + is_leap_year(year);
 }
 
+/* Returns whether timestamp a lies after timestamp b. */
+static int
+ts_after(struct timespec a, struct timespec b)
+{
+	return a.tv_sec != b.tv_sec ? a.tv_sec > b.tv_sec : a.tv_nsec > b.tv_nsec;
+}
+
+/* Like time(2), but consistent with the precise clock used to schedule wake-ups.
+ * On some systems time(2) reads a coarser clock that may lag behind it. */
+static time_t
+current_time(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	return now.tv_sec;
+}
+
+/* Like pthread_create(3), but with a small stack. The default one takes several
+ * megabytes, all of which mlockall() would lock in real-time mode. */
+static int
+start_thread(pthread_t *thread, void *(*func)(void *), void *arg)
+{
+	pthread_attr_t attr;
+	int err;
+
+	if ((err = pthread_attr_init(&attr))) return err;
+	pthread_attr_setstacksize(&attr, MAX(THREAD_STACK, PTHREAD_STACK_MIN));
+	err = pthread_create(thread, &attr, func, arg);
+	pthread_attr_destroy(&attr);
+	return err;
+}
+
 /* Exit with a warning message. Should only be called during initialization! */
 static void
 die(const char *fmt, ...)
@@ -130,16 +541,13 @@ die(const char *fmt, ...)
 	exit(EXIT_FAILURE);
 }
 
+/* Read all of the file that was opened as fd, and close it. */
 static char *
-read_file(const char *filename)
+read_file(int fd, const char *filename)
 {
 	struct stat info;
 	char *contents;
-	int fd;
 
-	fd = open(filename, O_RDONLY);
-	if (fd < 0)
-		die("Can't open %s: %m", filename);
 	if (fstat(fd, &info) < 0)
 		die("Can't stat %s: %m", filename);
 	if ((contents = malloc(info.st_size + 1)) == NULL)
@@ -152,9 +560,94 @@ read_file(const char *filename)
 	return contents;
 }
 
-/* Job time-finding algorithm. */
+/* Determine whether mday is the weekday nearest to one of the job's W days,
+ * or the month's last weekday if the job asks for that. */
+static int
+nearest_weekday(const struct Job *job, int mday, int wday, int dim)
+{
+	if (wday == 0 || wday == 6) return 0;
+	if (job->wmdays >> mday & 1) return 1;
+	if (job->wmdays & 1 && (mday == dim || (wday == 5 && mday + 2 >= dim))) return 1;
+	/* Saturdays move back to friday, sundays forward to monday, but never across a month. */
+	if (wday == 5 && mday + 1 <= dim && job->wmdays >> (mday + 1) & 1) return 1;
+	if (wday == 5 && mday + 2 == dim && job->wmdays >> dim & 1) return 1;
+	if (wday == 1 && mday > 1 && job->wmdays >> (mday - 1) & 1) return 1;
+	if (wday == 1 && mday == 3 && job->wmdays >> 1 & 1) return 1;
+	return 0;
+}
+
+/* Determine whether a job may run on the date in tm. */
+static int
+valid_date(const struct Job *job, const struct tm *tm)
+{
+	int dim;
+
+	if (!VALID_MONTH(*job, tm->tm_mon)) return 0;
+	if (VALID_DAY(*job, tm->tm_mday, tm->tm_wday)) return 1;
+	if (!(job->mdays & 1) && !job->wmdays && !job->nthwdays) return 0;
+
+	dim = days_in_month(tm->tm_mon, 1900 + tm->tm_year);
+	if (job->mdays & 1 && tm->tm_mday == dim) return 1;
+	if (VALID_NTH_WDAY(*job, (tm->tm_mday - 1) / 7, tm->tm_wday)) return 1;
+	if (tm->tm_mday + 7 > dim && VALID_NTH_WDAY(*job, LAST_NTH, tm->tm_wday)) return 1;
+	return nearest_weekday(job, tm->tm_mday, tm->tm_wday, dim);
+}
+
+/* If the time t falls into one of the blackout windows that a job avoids,
+ * postpone it to the end of that window. */
+static time_t
+defer_time(const struct Job *job, time_t t)
+{
+	struct tm tm;
+	struct Blackout *win = NULL;
+	int i, tries, minute, yday;
+
+	/* Postponing may land us in the same window on the next day, or in another window.
+	 * A window covers at most a week in a row, so unless the windows cover every day
+	 * completely, this gets out of all of them. */
+	for (tries = 0; tries < 8 * numBlackouts; ++tries) {
+		localtime_r(&t, &tm);
+		minute = tm.tm_hour * 60 + tm.tm_min;
+		yday = (tm.tm_wday + 6) % 7;
+		for (i = 0; i < numBlackouts; ++i) {
+			if (!(job->defer >> i & 1)) continue;
+			win = &blackouts[i];
+			if (win->begin < win->end) {
+				if (win->wdays >> tm.tm_wday & 1 && minute >= win->begin && minute < win->end) break;
+			} else {
+				if (win->wdays >> tm.tm_wday & 1 && minute >= win->begin) {
+					++tm.tm_mday;
+					break;
+				}
+				if (win->wdays >> yday & 1 && minute < win->end) break;
+			}
+		}
+		if (i == numBlackouts) break;
+
+		tm.tm_hour = win->end / 60;
+		tm.tm_min = win->end % 60 + job->lineno % ((DEFER_SPREAD) + 1);
+		tm.tm_sec = 0;
+		tm.tm_isdst = -1;
+		t = mktime(&tm);
+	}
+
+	return t;
+}
+
+/* Remember that the time or state of a job changed. */
 static void
-update_job(int idx, time_t now)
+touch_job(int idx)
+{
+	/* Frequent jobs don't take part in the queue. */
+	if (!jobs[idx].frequent) shardDirty[idx / shardLen] = 1;
+}
+
+/* Job time-finding algorithm. Finds the first time after now at which a job
+ * should be executed. Jobs that can't be scheduled get NEVER as their time.
+ * Doesn't touch any other jobs, so it can run on several jobs in parallel.
+ * Returns how many days it had to look ahead. */
+static int
+update_job(int idx, const struct tm *now)
 {
 	struct tm tm;
 	struct Job job;
@@ -163,18 +656,20 @@ update_job(int idx, time_t now)
 	int today_alright, lookahead = 0;
 
 	job = jobs[idx];
+	touch_job(idx);
 
-	localtime_r(&now, &tm);
+	tm = *now;
 	tm.tm_sec = 0;
 	tm.tm_isdst = -1;
 
-	today_alright = VALID_DATE(job, tm.tm_mday, tm.tm_wday, tm.tm_mon);
+	today_alright = valid_date(&job, &tm);
 
 	/* Determine minute, and exit early if possible. */
 	assert(job.minutes != 0);
 	if (today_alright && VALID_HOUR(job, tm.tm_hour)) {
 		++tm.tm_min;
-		minutes_left = job.minutes & ~0ULL << tm.tm_min;
+		/* Wildcards set bits beyond the last minute and hour, which mktime() would carry over. */
+		minutes_left = job.minutes & MINUTE_BITS & ~0ULL << tm.tm_min;
 		if (minutes_left != 0LL) {
 			tm.tm_min = ffsll(minutes_left) - 1;
 			goto finished;
@@ -186,7 +681,7 @@ update_job(int idx, time_t now)
 	assert(job.hours != 0);
 	if (today_alright) {
 		++tm.tm_hour;
-		hours_left = job.hours & ~0UL << tm.tm_hour;
+		hours_left = job.hours & HOUR_BITS & ~0UL << tm.tm_hour;
 		if (hours_left != 0L) {
 			tm.tm_hour = ffsl(hours_left) - 1;
 			goto finished;
@@ -197,9 +692,10 @@ update_job(int idx, time_t now)
 	/* Determine day, month, and year. */
 	do {
 		if (++lookahead > (MAX_LOOKAHEAD)) {
-			syslog(LOG_WARNING, "Job '%s' exceeded the maximum lookahead and will be ignored.", job.command);
-			jobs[idx] = jobs[--numJobs];
-			return;
+			syslog(LOG_WARNING, "Job #%d of %s exceeded the maximum lookahead and will be ignored.",
+				job.lineno, crontabs[job.file].path);
+			jobs[idx].time = NEVER;
+			return lookahead;
 		}
 
 		tm.tm_wday = (tm.tm_wday + 1) % 7;
@@ -210,26 +706,401 @@ update_job(int idx, time_t now)
 				++tm.tm_year;
 			}
 		}
-	} while (!VALID_DATE(job, tm.tm_mday, tm.tm_wday, tm.tm_mon));
+	} while (!valid_date(&job, &tm));
 
 finished:
 	jobs[idx].time = mktime(&tm);
+	if (job.defer) {
+		jobs[idx].time = defer_time(&job, jobs[idx].time);
+	}
+	return lookahead;
+}
+
+/* The time at which a job gets dispatched. */
+static time_t
+due_time(int idx)
+{
+	return jobs[idx].time + jobs[idx].delay;
+}
+
+/* The time at which ocrond has to wake up for a job.
+ * Jobs that should be pre-spawned need attention a little earlier than the others. */
+static time_t
+wake_time(int idx)
+{
+	if (jobs[idx].prespawn == PRESPAWN_WANTED && !jobs[idx].pid) {
+		return due_time(idx) - (PRESPAWN_LEAD);
+	}
+	return due_time(idx);
+}
+
+/* Remove a job from the queue. This moves the last job into idx. */
+static void
+remove_job(int idx)
+{
+	int i;
+
+	shardDirty[idx / shardLen] = 1;
+	shardDirty[(numJobs - 1) / shardLen] = 1;
+	jobs[idx] = jobs[--numJobs];
+
+	/* Keep the agenda pointing at the job that moved. */
+	if (jobs[idx].frequent) {
+		for (i = agendaNext; i < agendaLen; ++i) {
+			if (agenda[i].job == numJobs) agenda[i].job = idx;
+		}
+	}
+}
+
+static void
+scan_shard(int shard)
+{
+	int idx, end, next = -1;
+
+	end = MIN((shard + 1) * shardLen, numJobs);
+	for (idx = shard * shardLen; idx < end; ++idx) {
+		if (jobs[idx].frequent) continue;
+		if (next < 0 || wake_time(idx) < wake_time(next))
+			next = idx;
+	}
+	shardNext[shard] = next;
+	shardDirty[shard] = 0;
 }
 
 static int
 closest_job(void)
 {
-	int idx, next = 0;
+	int shard, idx, next = -1;
 	
-	if (!numJobs) return -1;
-	for (idx = 1; idx < numJobs; ++idx) {
-		if (jobs[idx].time < jobs[next].time)
+	for (shard = 0; shard < (SHARDS); ++shard) {
+		if (shardDirty[shard]) scan_shard(shard);
+		idx = shardNext[shard];
+		if (idx >= 0 && (next < 0 || wake_time(idx) < wake_time(next)))
 			next = idx;
 	}
 
 	return next;
 }
 
+/* Give a lazy job its exact time. */
+static void
+resolve_job(int idx)
+{
+	jobs[idx].lazy = 0;
+	update_job(idx, &restartTm);
+	++STATS(0).scheduled;
+}
+
+/* Find the job in the queue that is due next. Lazy jobs are resolved
+ * as they get to the front, until the front has an exact time. */
+static int
+next_job(void)
+{
+	int next;
+
+	while ((next = closest_job()) >= 0 && jobs[next].lazy) {
+		resolve_job(next);
+		if (jobs[next].time == NEVER) remove_job(next);
+	}
+	return next;
+}
+
+struct Day
+{
+	struct tm tm;
+	time_t begin;
+	time_t end;
+};
+
+/* Put an execution of a job on the agenda. */
+static void
+add_fire(int idx, time_t t)
+{
+	if (agendaLen < agendaCap) {
+		agenda[agendaLen].due = t + jobs[idx].delay;
+		agenda[agendaLen++].job = idx;
+	}
+}
+
+/* If t lies in the second pass through an hour that a DST switch repeats,
+ * the same local time in the first pass, and t otherwise. Stepping through the
+ * executions of a job only runs the repeated hour once, in its first pass. */
+static time_t
+first_pass(time_t t)
+{
+	struct tm tm, twin;
+	time_t u;
+
+	localtime_r(&t, &tm);
+	twin = tm;
+	twin.tm_isdst = !tm.tm_isdst;
+	u = mktime(&twin);
+	if (u != NEVER && u < t && twin.tm_hour == tm.tm_hour && twin.tm_min == tm.tm_min) return u;
+	return t;
+}
+
+/* The first execution of a frequent job after after, within the days that make up
+ * the span from from to to, or NEVER. Instead of asking update_job() for it, this
+ * checks the job's day and then simply walks its hours and minutes. */
+static time_t
+next_fire(int idx, time_t after, const struct Day days[], int numDays, time_t from, time_t to)
+{
+	struct tm tm;
+	unsigned long long minutes;
+	unsigned long hours;
+	time_t t, lo, hi;
+	int d, h, m, sec;
+
+	for (d = 0; d < numDays; ++d) {
+		lo = MAX(MAX(from, after) + 1, days[d].begin);
+		hi = MIN(to, days[d].end - 1);
+		if (lo > hi || !valid_date(&jobs[idx], &days[d].tm)) continue;
+
+		/* Days with a DST switch skip or repeat an hour. Leave those to update_job(). */
+		if (days[d].end - days[d].begin != 24 * 60 * 60) {
+			t = first_pass(lo - 1);
+			do {
+				localtime_r(&t, &tm);
+				/* mktime() may resolve a repeated hour by the offset it dealt with last.
+				 * Let that be the one at t, just as if we stepped through the executions. */
+				mktime(&tm);
+				update_job(idx, &tm);
+				t = jobs[idx].time;
+			} while (t != NEVER && t < lo);
+			if (t != NEVER && t <= hi) return t;
+			continue;
+		}
+
+		/* The first minute of the day that doesn't lie before lo. */
+		sec = lo - days[d].begin + 59;
+		h = sec / 3600;
+		m = sec % 3600 / 60;
+		if (VALID_HOUR(jobs[idx], h)) {
+			minutes = jobs[idx].minutes & MINUTE_BITS & ~0ULL << m;
+			if (minutes) {
+				t = days[d].begin + h * 3600 + (ffsll(minutes) - 1) * 60;
+				if (t <= hi) return t;
+				continue;
+			}
+		}
+		hours = jobs[idx].hours & HOUR_BITS & ~0UL << (h + 1);
+		minutes = jobs[idx].minutes & MINUTE_BITS;
+		if (!hours || !minutes) continue;
+		t = days[d].begin + (ffsl(hours) - 1) * 3600 + (ffsll(minutes) - 1) * 60;
+		if (t <= hi) return t;
+	}
+	return NEVER;
+}
+
+static int
+earlier_fire(const struct Fire *x, const struct Fire *y)
+{
+	return x->due != y->due ? x->due < y->due : x->job < y->job;
+}
+
+/* Restore the order of the heap of num pending executions below root. */
+static void
+sift_fire(int root, int num)
+{
+	struct Fire fire = pending[root];
+	int child;
+
+	while ((child = 2 * root + 1) < num) {
+		if (child + 1 < num && earlier_fire(&pending[child + 1], &pending[child])) ++child;
+		if (!earlier_fire(&pending[child], &fire)) break;
+		pending[root] = pending[child];
+		root = child;
+	}
+	pending[root] = fire;
+}
+
+/* Put all executions of the frequent jobs after from and up to to on the agenda, in order.
+ * The next execution of every job waits in a heap, and the earliest one goes next,
+ * which merges the executions of all jobs without having to sort them. */
+static void
+extend_agenda(time_t from, time_t to)
+{
+	struct Day days[4];
+	struct tm tm;
+	time_t t;
+	int numDays = 0, num = 0, idx;
+
+	/* Find the days that the span touches. */
+	localtime_r(&from, &tm);
+	tm.tm_hour = tm.tm_min = tm.tm_sec = 0;
+	tm.tm_isdst = -1;
+	t = mktime(&tm);
+	while (t <= to && numDays < 4) {
+		days[numDays].tm = tm;
+		days[numDays].begin = t;
+		++tm.tm_mday;
+		tm.tm_isdst = -1;
+		t = mktime(&tm);
+		days[numDays++].end = t;
+	}
+
+	for (idx = 0; idx < numJobs; ++idx) {
+		if (!jobs[idx].frequent) continue;
+		if ((t = next_fire(idx, from, days, numDays, from, to)) == NEVER) continue;
+		pending[num].due = t + jobs[idx].delay;
+		pending[num++].job = idx;
+	}
+	for (idx = num / 2; idx-- > 0;) sift_fire(idx, num);
+
+	while (num) {
+		idx = pending[0].job;
+		t = pending[0].due - jobs[idx].delay;
+		add_fire(idx, t);
+		if ((t = next_fire(idx, t, days, numDays, from, to)) == NEVER) {
+			pending[0] = pending[--num];
+		} else {
+			pending[0].due = t + jobs[idx].delay;
+		}
+		sift_fire(0, num);
+	}
+}
+
+/* Once enough of the agenda has been used up, drop what has been dispatched,
+ * and extend it to reach a full span ahead again. */
+static void
+fill_agenda(time_t now)
+{
+	int start;
+
+	if (!numFrequent || now < windowEnd - (AGENDA_SPAN) + (AGENDA_STEP)) return;
+	/* After a jump forward, anything in between has been missed anyway. */
+	if (windowEnd < now) windowEnd = now - now % 60;
+
+	memmove(agenda, agenda + agendaNext, (agendaLen - agendaNext) * sizeof(agenda[0]));
+	agendaLen -= agendaNext;
+	agendaNext = 0;
+
+	/* Everything that was already on the agenda comes before the new executions. */
+	start = agendaLen;
+	extend_agenda(windowEnd, now + (AGENDA_SPAN));
+	windowEnd = now + (AGENDA_SPAN);
+	STATS(0).scheduled += agendaLen - start;
+}
+
+/* When the agenda needs attention next, or NEVER if there are no frequent jobs. */
+static time_t
+agenda_wake(void)
+{
+	time_t refill;
+
+	if (!numFrequent) return NEVER;
+	refill = windowEnd - (AGENDA_SPAN) + (AGENDA_STEP);
+	if (agendaNext < agendaLen) return MIN(agenda[agendaNext].due, refill);
+	return refill;
+}
+
+/* Whether update_job() finds the next execution of a job after now without searching
+ * through the following days, which makes it cheap. */
+static int
+fires_today(const struct Job *job, const struct tm *now)
+{
+	if (!valid_date(job, now)) return 0;
+	if (VALID_HOUR(*job, now->tm_hour) && job->minutes & MINUTE_BITS & ~0ULL << (now->tm_min + 1)) return 1;
+	return (job->hours & HOUR_BITS & ~0UL << (now->tm_hour + 1)) != 0;
+}
+
+/* A cheap lower bound for the next execution of a job that doesn't fire today,
+ * using nothing but its bitmasks: not before its first hour tomorrow, or if this month
+ * isn't valid, not before its first hour in the next valid month. */
+static time_t
+lower_bound(const struct Job *job, time_t now, const struct tm *tm)
+{
+	time_t midnight;
+	int mon, year, days;
+
+	midnight = now - tm->tm_hour * 3600 - tm->tm_min * 60 - tm->tm_sec;
+	if (VALID_MONTH(*job, tm->tm_mon)) {
+		days = 1;
+	} else {
+		mon = tm->tm_mon;
+		year = 1900 + tm->tm_year;
+		days = days_in_month(mon, year) - tm->tm_mday + 1;
+		for (;;) {
+			if (++mon >= 12) {
+				mon = 0;
+				++year;
+			}
+			if (VALID_MONTH(*job, mon)) break;
+			days += days_in_month(mon, year);
+		}
+	}
+
+	return MAX(midnight + days * 86400L + (ffsl(job->hours & HOUR_BITS) - 1) * 3600L - DST_SLACK, now);
+}
+
+struct Restart
+{
+	pthread_t thread;
+	const struct tm *now;
+	time_t time;
+	int shard;
+};
+
+/* Jobs that fire later today get their exact time, which is cheap to find.
+ * All others only get a lower bound, and are resolved once they come up. */
+static void *
+restart_shard(void *arg)
+{
+	struct Restart *restart = arg;
+	int idx, end;
+
+	end = MIN((restart->shard + 1) * shardLen, numJobs);
+	for (idx = restart->shard * shardLen; idx < end; ++idx) {
+		if (jobs[idx].frequent) continue;
+		if (fires_today(&jobs[idx], restart->now)) {
+			update_job(idx, restart->now);
+			jobs[idx].lazy = 0;
+			++STATS(restart->shard).scheduled;
+		} else {
+			jobs[idx].time = lower_bound(&jobs[idx], restart->time, restart->now);
+			jobs[idx].lazy = 1;
+		}
+	}
+
+	return NULL;
+}
+
+/* Schedule all jobs from scratch. With enough jobs, every shard gets its own thread. */
+static void
+restart_jobs(time_t now)
+{
+	struct Restart restarts[SHARDS];
+	int shard, threaded;
+
+	localtime_r(&now, &restartTm);
+	shardLen = MAX((numJobs + (SHARDS) - 1) / (SHARDS), 1);
+	threaded = (SHARDS) > 1 && shardLen >= MIN_THREADED_SHARD;
+
+	for (shard = (SHARDS) - 1; shard >= 0; --shard) {
+		restarts[shard].now = &restartTm;
+		restarts[shard].time = now;
+		restarts[shard].shard = shard;
+		if (shard && threaded && !start_thread(&restarts[shard].thread, restart_shard, &restarts[shard])) {
+			continue;
+		}
+		restart_shard(&restarts[shard]);
+		restarts[shard].shard = -1;
+	}
+	for (shard = 1; shard < (SHARDS); ++shard) {
+		if (restarts[shard].shard >= 0) pthread_join(restarts[shard].thread, NULL);
+	}
+
+	/* Jobs that can't be scheduled anymore only turn up when they get resolved. */
+	for (shard = 0; shard < (SHARDS); ++shard) {
+		shardDirty[shard] = 1;
+	}
+
+	/* Start the agenda over at the current minute. */
+	agendaLen = agendaNext = 0;
+	windowEnd = now - now % 60;
+	fill_agenda(now);
+}
+
 /* Crontab parsing. */
 
 static int
@@ -286,10 +1157,66 @@ parse_value(const char *aliases[], int *number)
 	return -1;
 }
 
+/* Parses the month-day forms 'L' (the last day of the month),
+ * 'LW' (the last weekday of the month), and 'nW' (the weekday nearest to the n-th).
+ * Returns 1 if there is no such form to parse. */
 static int
-parse_range(int min, int max, const char *aliases[], long long *field)
+parse_mday_extension(long long *field, long long *extra)
 {
-	int first, last, step = 1, i;
+	char *start = text;
+	int mday;
+
+	if (eat_char('L')) {
+		if (eat_char('W')) *extra |= 1LL;
+		else *field |= 1LL;
+		return 0;
+	}
+	if (parse_number(&mday) == 0 && eat_char('W')) {
+		if (mday < 1 || mday > 31) return -1;
+		*extra |= 1LL << mday;
+		return 0;
+	}
+	text = start;
+	return 1;
+}
+
+/* Parses the week-day forms 'd#n' (the n-th such week-day of the month)
+ * and 'dL' (the last such week-day of the month).
+ * Returns 1 if there is no such form to parse. */
+static int
+parse_wday_extension(long long *field, long long *extra)
+{
+	char *start = text;
+	int wday, nth;
+
+	(void) field;
+	if (parse_value(wdays_aliases, &wday) == 0 && wday <= 7) {
+		wday %= 7;
+		if (eat_char('#')) {
+			if (parse_number(&nth) < 0 || nth < 1 || nth > LAST_NTH) return -1;
+			*extra |= 1LL << (7 * (nth - 1) + wday);
+			return 0;
+		}
+		if (eat_char('L')) {
+			*extra |= 1LL << (7 * LAST_NTH + wday);
+			return 0;
+		}
+	}
+	text = start;
+	return 1;
+}
+
+/* extension, if not NULL, parses the field-specific forms that don't fit into field,
+ * and may store them in extra. */
+static int
+parse_range(int min, int max, const char *aliases[], long long *field,
+	int (*extension)(long long *, long long *), long long *extra)
+{
+	int first, last, step = 1, i, ret;
+
+	if (extension && (ret = extension(field, extra)) <= 0) {
+		return ret;
+	}
 
 	if (eat_char('*')) {
 		if (eat_char('/')) {
@@ -324,40 +1251,260 @@ parse_range(int min, int max, const char *aliases[], long long *field)
 }
 
 static int
-parse_field(int min, int max, const char *aliases[], long long *field)
+parse_field(int min, int max, const char *aliases[], long long *field,
+	int (*extension)(long long *, long long *), long long *extra)
 {
 	*field = 0LL;
 	do {
-		if (parse_range(min, max, aliases, field) < 0) return -1;
+		if (parse_range(min, max, aliases, field, extension, extra) < 0) return -1;
 	} while (eat_char(','));
 	if (skip_space() < 0) return -1;
 	return 0;
 }
 
 static int
-parse_command(char **command)
+parse_inputs(char **inputs)
 {
+	char *end, *c;
 	size_t len;
 
-	len = eol - text;
+	end = text;
+	while (*end && !isspace(*end)) {
+		/* Reject empty paths. */
+		if (*end == ',' && (end == text || !end[1] || isspace(end[1]) || end[1] == ',')) return -1;
+		++end;
+	}
+	len = end - text;
 	if (!len) return -1;
-	if ((*command = malloc(len + 1)) == NULL) {
+	if ((*inputs = malloc(len + 2)) == NULL) {
 		die("Out of memory.");
 	}
-	memcpy(*command, text, len);
-	(*command)[len] = 0;
-	
+	memcpy(*inputs, text, len);
+	(*inputs)[len] = 0;
+	(*inputs)[len + 1] = 0;
+	for (c = *inputs; *c; ++c) {
+		if (*c == ',') *c = 0;
+	}
+	text = end;
+
 	return 0;
 }
 
 static int
-parse_line(int lineno)
+parse_group(struct Job *job)
 {
-	struct Job job;
-	long long field;
-
-	memset(&job, 0, sizeof(job));
-	job.lineno = lineno;
+	char *end;
+	int i;
+
+	end = text;
+	while (*end && !isspace(*end) && *end != '&') ++end;
+	if (end == text) return -1;
+	for (i = 0; i < numGroups; ++i) {
+		if (strncmp(groups[i], text, end - text) == 0 && !groups[i][end - text]) break;
+	}
+	if (i == numGroups) {
+		groups = reallocarray(groups, numGroups + 1, sizeof(groups[0]));
+		if (groups == NULL) die("Out of memory.");
+		if ((groups[i] = strndup(text, end - text)) == NULL) die("Out of memory.");
+		++numGroups;
+	}
+	job->group = i + 1;
+	text = end;
+	job->background = eat_char('&');
+
+	return 0;
+}
+
+static int
+parse_defer(struct Job *job)
+{
+	char *end;
+	int i;
+
+	end = text;
+	while (*end && !isspace(*end)) ++end;
+	for (i = 0; i < numBlackouts; ++i) {
+		if (strncmp(blackouts[i].name, text, end - text) == 0 && !blackouts[i].name[end - text]) break;
+	}
+	if (i == numBlackouts) return -1;
+	job->defer |= 1UL << i;
+	text = end;
+
+	return 0;
+}
+
+static int
+parse_priority(struct Job *job)
+{
+	int neg, num;
+
+	neg = eat_char('-');
+	if (parse_number(&num) < 0 || num > MAX_PRIORITY) return -1;
+	job->priority = neg ? -num : num;
+	/* Stopping everybody else's jobs is up to the administrator. */
+	if (parseFile && URGENT(*job)) return -1;
+
+	return 0;
+}
+
+/* Parses the optional job attributes between the week-days field and the command.
+ * Each attribute is of the form @name or @name=value and is followed by whitespace. */
+static int
+parse_attributes(struct Job *job)
+{
+	while (eat_char('@')) {
+		if (strncmp(text, "inputs=", 7) == 0 && !job->inputs) {
+			text += 7;
+			if (parse_inputs(&job->inputs) < 0) return -1;
+		} else if (strncmp(text, "group=", 6) == 0 && !job->group) {
+			text += 6;
+			if (parse_group(job) < 0) return -1;
+		} else if (strncmp(text, "defer=", 6) == 0) {
+			text += 6;
+			if (parse_defer(job) < 0) return -1;
+		} else if (strncmp(text, "defer", 5) == 0) {
+			text += 5;
+			job->defer = ~0UL;
+		} else if (strncmp(text, "priority=", 9) == 0) {
+			text += 9;
+			if (parse_priority(job) < 0) return -1;
+		} else if (strncmp(text, "prespawn", 8) == 0) {
+			text += 8;
+			job->prespawn = PRESPAWN_WANTED;
+		} else return -1;
+		if (skip_space() < 0) return -1;
+	}
+
+	return 0;
+}
+
+/* Splits the len characters of a crontab command at in into the command itself,
+ * and the text that should be passed to its stdin, and stores both at out,
+ * which must have room for len + 1 characters and may be the same as in.
+ * As usual, the first unescaped percent sign separates the two,
+ * and any further ones stand for newlines. Returns the stdin text, or NULL. */
+static char *
+unescape_command(const char *in, size_t len, char *out)
+{
+	const char *end = in + len;
+	char *payload = NULL;
+
+	for (; in < end; ++in) {
+		if (*in == '\\' && in + 1 < end && in[1] == '%') {
+			*out++ = *++in;
+		} else if (*in == '%' && !payload) {
+			*out++ = 0;
+			payload = out;
+		} else if (*in == '%') {
+			*out++ = '\n';
+		} else {
+			*out++ = *in;
+		}
+	}
+	*out = 0;
+
+	return payload;
+}
+
+/* Parses the command. Commands from the spool are only indexed,
+ * all others are loaded right away. */
+static int
+parse_command(struct Job *job)
+{
+	const char *c;
+	size_t len;
+
+	len = eol - text;
+	if (!len || *text == '%') return -1;
+	job->cmdoff = text - parseContents;
+	job->cmdlen = len;
+	for (c = text; c < eol; ++c) {
+		if (*c == '\\' && c + 1 < eol && c[1] == '%') ++c;
+		else if (*c == '%') job->feed = 1;
+	}
+
+	if (!parseFile) {
+		if ((job->command = malloc(len + 1)) == NULL) {
+			die("Out of memory.");
+		}
+		job->payload = unescape_command(text, len, job->command);
+	}
+	text = eol;
+	
+	return 0;
+}
+
+static int
+parse_clock(short *minute)
+{
+	int hour, min;
+
+	if (parse_number(&hour) < 0) return -1;
+	if (!eat_char(':')) return -1;
+	if (parse_number(&min) < 0) return -1;
+	if (hour > 24 || min > 59 || (hour == 24 && min)) return -1;
+	*minute = hour * 60 + min;
+
+	return 0;
+}
+
+/* Parses the rest of a line of the form '@blackout [name] week-days hh:mm-hh:mm'. */
+static int
+parse_blackout(void)
+{
+	struct Blackout win;
+	long long field;
+	char *start;
+
+	if (numBlackouts >= MAX_BLACKOUTS) return -1;
+	if (skip_space() < 0) return -1;
+
+	/* Without a name, the window goes by its index. */
+	start = text;
+	win.name = NULL;
+	if (parse_field(0, 7, wdays_aliases, &field, NULL, NULL) < 0) {
+		text = start;
+		while (*text && !isspace(*text)) ++text;
+		if ((win.name = strndup(start, text - start)) == NULL) die("Out of memory.");
+		if (skip_space() < 0 || parse_field(0, 7, wdays_aliases, &field, NULL, NULL) < 0) {
+			free(win.name);
+			return -1;
+		}
+	}
+	win.wdays = field ? field | (field >> 7 & 1) : 0x7F;
+
+	if (parse_clock(&win.begin) < 0 || !eat_char('-') || parse_clock(&win.end) < 0) {
+		free(win.name);
+		return -1;
+	}
+	skip_space();
+	if (text != eol) {
+		free(win.name);
+		return -1;
+	}
+	if (win.name == NULL) {
+		if ((win.name = malloc(12)) == NULL) die("Out of memory.");
+		snprintf(win.name, 12, "%d", numBlackouts);
+	}
+
+	blackouts = reallocarray(blackouts, numBlackouts + 1, sizeof(blackouts[0]));
+	if (blackouts == NULL) die("Out of memory.");
+	blackouts[numBlackouts++] = win;
+
+	return 0;
+}
+
+static int
+parse_line(int lineno)
+{
+	struct Job job;
+	long long field, extra;
+	char *start;
+
+	memset(&job, 0, sizeof(job));
+	job.lineno = lineno;
+	job.statusfd = -1;
+	job.gate = -1;
 
 	/* We don't care if we actually find spaces here or not. */
 	skip_space();
@@ -365,30 +1512,49 @@ parse_line(int lineno)
 	/* Dismiss empty lines and comments. */
 	if (*text == '#') return 0;
 	if (!*text || *text == '\n') return 0;
+
+	/* Blackout windows are up to the administrator. */
+	if (strncmp(text, "@blackout", 9) == 0) {
+		if (parseFile) return -1;
+		text += 9;
+		return parse_blackout();
+	}
 	
-	if (parse_field(0, 59, no_aliases, &field) < 0) return -1;
+	start = text;
+	job.hash = fnv1a(0xcbf29ce484222325ULL ^ lineno, crontabs[parseFile].path, strlen(crontabs[parseFile].path));
+	job.hash = fnv1a(job.hash, start, eol - start);
+	job.file = parseFile;
+
+	if (parse_field(0, 59, no_aliases, &field, NULL, NULL) < 0) return -1;
 	job.minutes = field;
 
-	if (parse_field(0, 23, no_aliases, &field) < 0) return -1;
+	if (parse_field(0, 23, no_aliases, &field, NULL, NULL) < 0) return -1;
 	job.hours = field;
 
-	if (parse_field(1, 31, no_aliases, &field) < 0) return -1;
+	extra = 0LL;
+	if (parse_field(1, 31, no_aliases, &field, parse_mday_extension, &extra) < 0) return -1;
 	job.mdays = field;
+	job.wmdays = extra;
 
-	if (parse_field(0, 11, months_aliases, &field) < 0) return -1;
+	if (parse_field(0, 11, months_aliases, &field, NULL, NULL) < 0) return -1;
 	job.months = field;
 
-	if (parse_field(0, 7, wdays_aliases, &field) < 0) return -1;
+	extra = 0LL;
+	if (parse_field(0, 7, wdays_aliases, &field, parse_wday_extension, &extra) < 0) return -1;
 	job.wdays = field;
+	job.nthwdays = extra;
 
-	if (parse_command(&job.command) < 0) return -1;
+	if (parse_attributes(&job) < 0 || parse_command(&job) < 0) {
+		free(job.inputs);
+		return -1;
+	}
 
 	/* Fill in unrestricted fields. */
 	if (!job.minutes) job.minutes = ~0LL;
 	if (!job.hours) job.hours = ~0L;
 	if (!job.months) job.months = ~0;
 	job.wdays |= job.wdays >> 7 & 1;
-	if (!job.mdays && !job.wdays) {
+	if (!job.mdays && !job.wdays && !job.wmdays && !job.nthwdays) {
 		job.mdays = ~0L;
 	}
 
@@ -404,23 +1570,277 @@ parse_line(int lineno)
 }
 
 static void
-parse_file(const char *filename)
+parse_file(int idx, int fd)
 {
-	char *contents;
 	int lineno = 1;
 
-	contents = read_file(filename);
-	text = contents;
+	parseFile = idx;
+	parseContents = read_file(fd, crontabs[parseFile].path);
+	text = parseContents;
 	do {
 		eol = pstrchrnul(text, '\n');
 		if (parse_line(lineno) < 0) {
-			syslog(LOG_WARNING, "Line %d of %s will be ignored because of bad syntax.\n", lineno, filename);
+			syslog(LOG_WARNING, "Line %d of %s will be ignored because of bad syntax.\n", lineno, crontabs[parseFile].path);
 		}
 		text = eol + 1;
 		++lineno;
 	} while (*eol);
 	text = NULL;
-	free(contents);
+	free(parseContents);
+	parseContents = NULL;
+}
+
+static int
+add_crontab(const char *path, const char *user, const char *home, uid_t uid, gid_t gid)
+{
+	struct Crontab *tab;
+
+	crontabs = reallocarray(crontabs, numCrontabs + 1, sizeof(crontabs[0]));
+	if (crontabs == NULL) die("Out of memory.");
+	tab = &crontabs[numCrontabs];
+	memset(tab, 0, sizeof(*tab));
+	if ((tab->path = strdup(path)) == NULL) die("Out of memory.");
+	if (user && (tab->user = strdup(user)) == NULL) die("Out of memory.");
+	if (home && (tab->home = strdup(home)) == NULL) die("Out of memory.");
+	tab->uid = uid;
+	tab->gid = gid;
+
+	return numCrontabs++;
+}
+
+/* Load the crontabs of all users from the spool directory.
+ * Each crontab is named after its user, and has to be owned by that user or root,
+ * and must not be writable by anybody else. */
+static void
+load_spool(void)
+{
+	char path[PATH_MAX];
+	struct dirent *entry;
+	struct passwd *pw;
+	struct stat info;
+	DIR *dir;
+	int idx, fd;
+
+	if ((dir = opendir(spoolDir)) == NULL) {
+		if (errno != ENOENT) syslog(LOG_WARNING, "Can't open %s: %m", spoolDir);
+		return;
+	}
+	while ((entry = readdir(dir)) != NULL) {
+		if (entry->d_name[0] == '.') continue;
+		snprintf(path, sizeof(path), "%s/%s", spoolDir, entry->d_name);
+		/* Check the very file that gets parsed, and not what a symlink points to.
+		 * A hard link could pass off somebody else's file as the user's crontab. */
+		if ((fd = open(path, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC)) < 0) {
+			if (errno == ELOOP) syslog(LOG_WARNING, "%s will be ignored because it is a symbolic link.", path);
+			continue;
+		}
+		if (fstat(fd, &info) < 0 || !S_ISREG(info.st_mode)) {
+			close(fd);
+			continue;
+		}
+		if ((pw = getpwnam(entry->d_name)) == NULL) {
+			syslog(LOG_WARNING, "%s will be ignored because there is no such user.", path);
+			close(fd);
+			continue;
+		}
+		if ((info.st_uid != pw->pw_uid && info.st_uid != 0) || info.st_mode & (S_IWGRP | S_IWOTH) || info.st_nlink != 1) {
+			syslog(LOG_WARNING, "%s will be ignored because of unsafe ownership or permissions.", path);
+			close(fd);
+			continue;
+		}
+		idx = add_crontab(path, pw->pw_name, pw->pw_dir, pw->pw_uid, pw->pw_gid);
+		crontabs[idx].mtime = info.st_mtim;
+		crontabs[idx].ino = info.st_ino;
+		parse_file(idx, fd);
+	}
+	closedir(dir);
+}
+
+/* Whether info describes the same, unmodified file that a crontab was loaded from. */
+static int
+same_crontab(const struct Crontab *tab, const struct stat *info)
+{
+	return info->st_ino == tab->ino && info->st_mtim.tv_sec == tab->mtime.tv_sec
+		&& info->st_mtim.tv_nsec == tab->mtime.tv_nsec;
+}
+
+/* Whether a crontab from the spool was modified or replaced since it was loaded.
+ * It's only looked at once per dispatch, which happens at the time now. */
+static int
+crontab_changed(int file, time_t now)
+{
+	struct stat info;
+
+	if (!file || crontabs[file].checked == now) return 0;
+	if (lstat(crontabs[file].path, &info) < 0 || !same_crontab(&crontabs[file], &info)) return 1;
+	crontabs[file].checked = now;
+	return 0;
+}
+
+/* Make sure that the command of a job is in memory.
+ * Commands from the spool get read into a scratch buffer that is reused
+ * by the next job, so they have to be unloaded again after use. */
+static int
+load_command(int idx)
+{
+	struct Crontab *tab;
+	struct stat info;
+	int fd, ok;
+
+	if (jobs[idx].command) return 0;
+
+	tab = &crontabs[jobs[idx].file];
+	if ((fd = open(tab->path, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC)) < 0) {
+		syslog(LOG_WARNING, "Can't open %s: %m", tab->path);
+		return -1;
+	}
+	ok = fstat(fd, &info) == 0 && same_crontab(tab, &info);
+	ok = ok && pread(fd, cmdbuf, jobs[idx].cmdlen, jobs[idx].cmdoff) == (ssize_t) jobs[idx].cmdlen;
+	close(fd);
+	/* dispatch() looks for changes beforehand, so this only happens if we lost a race against the editor. */
+	if (!ok) {
+		syslog(LOG_WARNING, "Job #%d won't be executed since %s just changed. It will be reloaded before its next job.",
+			jobs[idx].lineno, tab->path);
+		return -1;
+	}
+
+	jobs[idx].command = cmdbuf;
+	jobs[idx].payload = unescape_command(cmdbuf, jobs[idx].cmdlen, cmdbuf);
+	return 0;
+}
+
+static void
+unload_command(int idx)
+{
+	if (jobs[idx].file) {
+		jobs[idx].command = NULL;
+		jobs[idx].payload = NULL;
+	}
+}
+
+/* Load the crontab, and allocate all the scratch space needed to dispatch its jobs. */
+static void
+load_jobs(void)
+{
+	size_t size, cap = 0;
+	int group, idx, fd;
+
+	add_crontab(crontabPath, NULL, NULL, 0, 0);
+	if (!(access(crontabPath, F_OK) < 0)) {
+		if ((fd = open(crontabPath, O_RDONLY)) < 0)
+			die("Can't open %s: %m", crontabPath);
+		parse_file(0, fd);
+	}
+	load_spool();
+
+	size = 0;
+	for (idx = 0; idx < numJobs; ++idx) {
+		if (jobs[idx].file && jobs[idx].cmdlen > size) size = jobs[idx].cmdlen;
+	}
+	cmdbufSize = size + 1;
+	if ((cmdbuf = malloc(cmdbufSize)) == NULL) {
+		die("Out of memory.");
+	}
+
+	if ((batch = calloc(numJobs + 1, sizeof(batch[0]))) == NULL) {
+		die("Out of memory.");
+	}
+	if ((dueJobs = calloc(numJobs + 1, sizeof(dueJobs[0]))) == NULL) {
+		die("Out of memory.");
+	}
+
+	/* Only try to run the jobs we don't own once their owner had a chance to.
+	 * The low bits of FNV hashes are poorly mixed, so we shard by the high ones. */
+	for (idx = 0; idx < numJobs; ++idx) {
+		if ((jobs[idx].hash >> 32) % numInstances != instance) {
+			jobs[idx].delay = LOCK_GRACE;
+		}
+	}
+
+	/* Jobs that fire often enough go on the agenda, which needs room for a day's worth
+	 * of their executions. A DST switch can repeat an hour, so one more hour's worth. */
+	for (idx = 0; idx < numJobs; ++idx) {
+		if (!(AGENDA_MIN_FIRES) || jobs[idx].defer || jobs[idx].prespawn) continue;
+		size = count_bits(jobs[idx].minutes & MINUTE_BITS);
+		if (size * count_bits(jobs[idx].hours & HOUR_BITS) < (AGENDA_MIN_FIRES)) continue;
+		jobs[idx].frequent = 1;
+		++numFrequent;
+		agendaCap += size * (count_bits(jobs[idx].hours & HOUR_BITS) + 1);
+	}
+	if (agendaCap && (agenda = calloc(agendaCap, sizeof(agenda[0]))) == NULL) {
+		die("Out of memory.");
+	}
+	if (numFrequent && (pending = calloc(numFrequent, sizeof(pending[0]))) == NULL) {
+		die("Out of memory.");
+	}
+
+	for (group = 1; group <= numGroups; ++group) {
+		size = sizeof(BATCH_TRAILER);
+		for (idx = 0; idx < numJobs; ++idx) {
+			if (jobs[idx].group == group) {
+				size += BATCH_QUOTING * jobs[idx].cmdlen + BATCH_OVERHEAD;
+			}
+		}
+		if (size > cap) cap = size;
+	}
+	scriptSize = cap;
+	if (cap && (script = malloc(cap)) == NULL) {
+		die("Out of memory.");
+	}
+}
+
+/* Stop the process groups of all running jobs and batches without urgent jobs,
+ * so that the urgent ones get the machine to themselves. */
+static void
+pause_jobs(void)
+{
+	pid_t pid;
+	int idx, other;
+
+	for (idx = 0; idx < numJobs; ++idx) {
+		if (!LEADS_PROCESS(jobs[idx]) || jobs[idx].paused) continue;
+		/* A pre-spawned process waits at its gate without using the machine, and is paused once it's let through. */
+		if (jobs[idx].gate >= 0) continue;
+		pid = jobs[idx].pid;
+		for (other = 0; other < numJobs; ++other) {
+			if (jobs[other].pid == pid && URGENT(jobs[other])) break;
+		}
+		if (other < numJobs) continue;
+		/* Every job is the leader of its own process group, see setup_child(). */
+		if (kill(-pid, SIGSTOP) < 0) {
+			syslog(LOG_WARNING, "Can't pause pid %d: %m", pid);
+			continue;
+		}
+		syslog(LOG_NOTICE, "Pausing pid %d for urgent jobs.", pid);
+		++STATS(0).paused;
+		for (other = 0; other < numJobs; ++other) {
+			if (jobs[other].pid == pid) jobs[other].paused = 1;
+		}
+	}
+}
+
+static void
+resume_jobs(void)
+{
+	int idx;
+
+	for (idx = 0; idx < numJobs; ++idx) {
+		if (!jobs[idx].paused) continue;
+		if (LEADS_PROCESS(jobs[idx])) {
+			syslog(LOG_NOTICE, "Resuming pid %d.", jobs[idx].pid);
+			if (kill(-jobs[idx].pid, SIGCONT) < 0) {
+				syslog(LOG_WARNING, "Can't resume pid %d: %m", jobs[idx].pid);
+			}
+		}
+		jobs[idx].paused = 0;
+	}
+}
+
+/* Account for an urgent job that exited. The paused jobs may go on once the last one did. */
+static void
+urgent_exited(void)
+{
+	if (!--numUrgent) resume_jobs();
 }
 
 static void
@@ -428,46 +1848,709 @@ free_jobs(void)
 {
 	int idx;
 
+	/* We lose track of the running jobs, so nobody would ever resume these. */
+	resume_jobs();
+	numUrgent = 0;
 	for (idx = 0; idx < numJobs; ++idx) {
-		free(jobs[idx].command);
+		if (!jobs[idx].file) free(jobs[idx].command);
+		free(jobs[idx].inputs);
+		/* Members of the same batch share their status file,
+		 * so some of these calls will harmlessly fail with EBADF. */
+		if (jobs[idx].statusfd >= 0) close(jobs[idx].statusfd);
+		/* Closing the gate makes a pre-spawned process exit without executing. */
+		if (jobs[idx].gate >= 0) close(jobs[idx].gate);
+	}
+	for (idx = 0; idx < numGroups; ++idx) {
+		free(groups[idx]);
+	}
+	for (idx = 0; idx < numBlackouts; ++idx) {
+		free(blackouts[idx].name);
+	}
+	for (idx = 0; idx < numCrontabs; ++idx) {
+		free(crontabs[idx].path);
+		free(crontabs[idx].user);
+		free(crontabs[idx].home);
 	}
 
 	free(jobs);
 	jobs = NULL;
 	numJobs = 0;
 	capJobs = 0;
+	free(groups);
+	groups = NULL;
+	numGroups = 0;
+	free(blackouts);
+	blackouts = NULL;
+	numBlackouts = 0;
+	free(batch);
+	batch = NULL;
+	free(dueJobs);
+	dueJobs = NULL;
+	free(script);
+	script = NULL;
+	free(crontabs);
+	crontabs = NULL;
+	numCrontabs = 0;
+	free(cmdbuf);
+	cmdbuf = NULL;
+	free(agenda);
+	agenda = NULL;
+	free(pending);
+	pending = NULL;
+	numFrequent = agendaCap = agendaLen = agendaNext = 0;
+}
+
+/* Determine whether any input of a job changed since its last successful run.
+ * Records the newest modification time in the job, so that it can be committed
+ * once the job returns successfully. Missing inputs always count as changed. */
+static int
+inputs_changed(int idx)
+{
+	struct stat info;
+	const char *path;
+	int changed = 0;
+
+	jobs[idx].seen.tv_sec = 0;
+	jobs[idx].seen.tv_nsec = 0L;
+	for (path = jobs[idx].inputs; *path; path += strlen(path) + 1) {
+		if (stat(path, &info) < 0) {
+			changed = 1;
+		} else if (ts_after(info.st_mtim, jobs[idx].seen)) {
+			jobs[idx].seen = info.st_mtim;
+		}
+	}
+
+	return changed || ts_after(jobs[idx].seen, jobs[idx].done);
+}
+
+/* Make sure that no other ocrond instance that shares the lock directory
+ * executes the same job at the same time. The lock file of a job holds the
+ * latest scheduled time for which any instance claimed it. */
+static int
+claim_job(int idx)
+{
+	char path[PATH_MAX], buf[32];
+	struct flock lock;
+	ssize_t len;
+	int fd, claimed = 0;
+
+	snprintf(path, sizeof(path), "%s/%016llx", lockDir, jobs[idx].hash);
+	if ((fd = open(path, O_RDWR | O_CREAT, 0644)) < 0) {
+		syslog(LOG_WARNING, "Can't open %s, executing job #%d regardless: %m", path, jobs[idx].lineno);
+		return 1;
+	}
+
+	memset(&lock, 0, sizeof(lock));
+	lock.l_type = F_WRLCK;
+	lock.l_whence = SEEK_SET;
+	while (fcntl(fd, F_SETLKW, &lock) < 0) {
+		if (errno != EINTR) {
+			syslog(LOG_WARNING, "Can't lock %s, executing job #%d regardless: %m", path, jobs[idx].lineno);
+			close(fd);
+			return 1;
+		}
+	}
+
+	if ((len = pread(fd, buf, sizeof(buf) - 1, 0)) < 0) len = 0;
+	buf[len] = 0;
+	if (!len || strtoll(buf, NULL, 10) < jobs[idx].time) {
+		len = snprintf(buf, sizeof(buf), "%lld\n", (long long) jobs[idx].time);
+		claimed = pwrite(fd, buf, len, 0) == len;
+	}
+
+	/* Closing the file also releases the lock. */
+	close(fd);
+	return claimed;
+}
+
+/* Determine whether a job that came due should actually be executed. */
+static int
+ready_job(int idx)
+{
+	/* Only execute the job if it isn't currently running. */
+	if (jobs[idx].pid && jobs[idx].gate < 0) {
+		syslog(LOG_WARNING, "Job #%d won't be executed since it is still running.", jobs[idx].lineno);
+		++STATS(0).running;
+		return 0;
+	}
+
+	/* The execution is claimed even if the inputs turn out to be up to date,
+	 * so that the other instances don't run it after all. */
+	if (lockDir && !claim_job(idx)) {
+		syslog(LOG_INFO, "Job #%d won't be executed since another instance already did.", jobs[idx].lineno);
+		++STATS(0).claimed;
+		return 0;
+	}
+
+	/* Like make(1), don't bother running a job whose inputs are up to date. */
+	if (jobs[idx].inputs && !inputs_changed(idx)) {
+		syslog(LOG_INFO, "Job #%d won't be executed since its inputs didn't change.", jobs[idx].lineno);
+		++STATS(0).unchanged;
+		return 0;
+	}
+
+	return 1;
+}
+
+/* Prepare a file descriptor from which a job can read its stdin text.
+ * Texts that fit go through a pipe that gets filled right away, longer ones
+ * through an unlinked temporary file. Either way, ocrond never blocks on the job
+ * and doesn't need a helper process to feed it. */
+static int
+open_payload(int idx)
+{
+	char template[] = TEMPFILE;
+	const char *payload;
+	size_t len;
+	ssize_t ret;
+	int fds[2], fd;
+
+	payload = jobs[idx].payload;
+	len = strlen(payload);
+
+	if (pipe(fds) == 0) {
+		fcntl(fds[1], F_SETFL, O_NONBLOCK);
+		ret = write(fds[1], payload, len);
+		close(fds[1]);
+		if (ret >= 0 && (size_t) ret == len) {
+			fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+			return fds[0];
+		}
+		close(fds[0]);
+	}
+
+	if ((fd = mkstemp(template)) < 0) return -1;
+	unlink(template);
+	if (writeall(fd, payload, len) < 0 || lseek(fd, 0, SEEK_SET) < 0) {
+		close(fd);
+		return -1;
+	}
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	return fd;
+}
+
+/* Prepare a freshly forked child for executing a job from the crontab file.
+ * input is the descriptor that should become its stdin, or -1. */
+static void
+setup_child(int file, int input)
+{
+	struct sched_param param;
+	struct Crontab *tab;
+	sigset_t none;
+
+	/* The parent does the same, so that the group exists as soon as either of us
+	 * got to it. The parent may want to signal it right away. */
+	setpgid(0, 0);
+	if (input >= 0) {
+		dup2(input, 0);
+		close(input);
+	}
+	/* The signal mask survives exec, and shells can't wait for their children with SIGCHLD blocked. */
+	sigemptyset(&none);
+	sigprocmask(SIG_SETMASK, &none, NULL);
+
+	/* Memory locks aren't inherited, but the scheduling policy is. */
+	if (realtime) {
+		memset(&param, 0, sizeof(param));
+		sched_setscheduler(0, SCHED_OTHER, &param);
+		setpriority(PRIO_PROCESS, 0, 0);
+	}
+
+	/* Jobs from the spool run as the user that they belong to. */
+	if (file) {
+		tab = &crontabs[file];
+		if (initgroups(tab->user, tab->gid) < 0 || setgid(tab->gid) < 0 || setuid(tab->uid) < 0) {
+			exit(137);
+		}
+		if (chdir(tab->home) < 0) chdir("/");
+		setenv("HOME", tab->home, 1);
+		setenv("USER", tab->user, 1);
+		setenv("LOGNAME", tab->user, 1);
+		setenv("SHELL", SHELL, 1);
+	}
+}
+
+/* Whether a command consists of nothing but plain words and doesn't start
+ * with a shell builtin, so that it means the same with or without a shell,
+ * and can be executed directly. */
+static int
+plain_command(const char *command)
+{
+	const char *c;
+	size_t len;
+	int i, words = 0, first = 1;
+
+	command += strspn(command, " \t");
+	len = strcspn(command, " \t");
+	for (i = 0; shell_builtins[i]; ++i) {
+		if (strlen(shell_builtins[i]) == len && !strncmp(command, shell_builtins[i], len)) return 0;
+	}
+
+	for (c = command; *c; ++c) {
+		if (isblank(*c)) {
+			if (words) first = 0;
+			continue;
+		}
+		if (c == command || isblank(c[-1])) ++words;
+		if (!isalnum(*c) && !strchr("-_./,:+@=%", *c)) return 0;
+		/* Leading assignments are for the shell to handle. */
+		if (first && *c == '=') return 0;
+	}
+
+	return words && words <= MAX_DIRECT_ARGS;
+}
+
+/* Turn a prepared child into the job's command. Only returns on failure. */
+static void
+exec_job(int idx)
+{
+	char *argv[MAX_DIRECT_ARGS + 1], *copy, *word;
+	int argc = 0;
+
+	/* Spare ourselves the shell where we can. */
+	if (plain_command(jobs[idx].command) && (copy = strdup(jobs[idx].command)) != NULL) {
+		for (word = strtok(copy, " \t"); word; word = strtok(NULL, " \t")) {
+			argv[argc++] = word;
+		}
+		argv[argc] = NULL;
+		execvp(argv[0], argv);
+		/* Maybe it's a shell builtin, so let the shell have a go. */
+		free(copy);
+	}
+	execl(SHELL, SHELL, "-c", jobs[idx].command, NULL);
+}
+
+/* Account for a job that was just started. */
+static void
+count_start(int idx)
+{
+	struct timespec now;
+	long long ms;
+	int bucket = 0;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	ms = (now.tv_sec - due_time(idx)) * 1000LL + now.tv_nsec / 1000000;
+	while (ms > 0 && bucket < LATENCY_BUCKETS - 1) {
+		ms >>= 1;
+		++bucket;
+	}
+	++STATS(0).started;
+	++STATS(0).latency[bucket];
 }
 
 /* Execute a job. */
+static void
+start_job(int idx)
+{
+	pid_t pid;
+	int input = -1, released;
+
+	/* A pre-spawned job only has to be let through its gate. */
+	if (jobs[idx].gate >= 0) {
+		released = write(jobs[idx].gate, "", 1) == 1;
+		if (!released) {
+			syslog(LOG_EMERG, "Cannot release job #%d: %m", jobs[idx].lineno);
+			++STATS(0).failed;
+		}
+		close(jobs[idx].gate);
+		jobs[idx].gate = -1;
+		if (!released) return;
+		count_start(idx);
+		syslog(LOG_NOTICE, "Executing job #%d with pid %d.", jobs[idx].lineno, jobs[idx].pid);
+		jobs[idx].started = current_time();
+		/* A job that starts while urgent jobs run has to wait for them. */
+		if (URGENT(jobs[idx])) ++numUrgent;
+		if (numUrgent) pause_jobs();
+		return;
+	}
+
+	if (load_command(idx) < 0) return;
+	if (jobs[idx].payload && (input = open_payload(idx)) < 0) {
+		syslog(LOG_EMERG, "Cannot pass stdin to job #%d: %m", jobs[idx].lineno);
+		unload_command(idx);
+		return;
+	}
+
+	switch (pid = fork()) {
+	case -1:
+		syslog(LOG_EMERG, "Cannot start a new process: %m");
+		++STATS(0).failed;
+		break;
+
+	case 0:
+		setup_child(jobs[idx].file, input);
+		exec_job(idx);
+		exit(137);
+
+	default:
+		setpgid(pid, pid);
+		count_start(idx);
+		syslog(LOG_NOTICE, "Executing job #%d with pid %d.", jobs[idx].lineno, pid);
+		jobs[idx].pid = pid;
+		jobs[idx].started = current_time();
+		touch_job(idx);
+		/* A job that starts while urgent jobs run has to wait for them. */
+		if (URGENT(jobs[idx])) ++numUrgent;
+		if (numUrgent) pause_jobs();
+		break;
+	}
+	if (input >= 0) close(input);
+	unload_command(idx);
+}
+
+/* Spawn the process of a job ahead of its time, and let it wait at a gate,
+ * so that only the exec remains to be done once the job comes due. */
+static void
+prespawn_job(int idx)
+{
+	ssize_t len;
+	pid_t pid;
+	char c;
+	int fds[2], input = -1;
+
+	touch_job(idx);
+	if (load_command(idx) < 0) {
+		jobs[idx].prespawn = PRESPAWN_FAILED;
+		return;
+	}
+	if (jobs[idx].payload && (input = open_payload(idx)) < 0) {
+		syslog(LOG_EMERG, "Cannot pass stdin to job #%d: %m", jobs[idx].lineno);
+		goto failed;
+	}
+	if (pipe(fds) < 0) {
+		syslog(LOG_EMERG, "Cannot pre-spawn job #%d: %m", jobs[idx].lineno);
+		goto failed;
+	}
+	fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+	fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+
+	switch (pid = fork()) {
+	case -1:
+		syslog(LOG_EMERG, "Cannot start a new process: %m");
+		close(fds[0]);
+		close(fds[1]);
+		goto failed;
+
+	case 0:
+		setup_child(jobs[idx].file, input);
+		close(fds[1]);
+		/* If the gate gets closed without a go, the job was cancelled. */
+		while ((len = read(fds[0], &c, 1)) < 0 && errno == EINTR);
+		if (len != 1) _exit(0);
+		close(fds[0]);
+		exec_job(idx);
+		exit(137);
+
+	default:
+		setpgid(pid, pid);
+		close(fds[0]);
+		if (input >= 0) close(input);
+		unload_command(idx);
+		jobs[idx].pid = pid;
+		jobs[idx].gate = fds[1];
+		++STATS(0).prespawned;
+		return;
+	}
+
+failed:
+	if (input >= 0) close(input);
+	unload_command(idx);
+	jobs[idx].prespawn = PRESPAWN_FAILED;
+}
+
 static void
 run_job(int idx)
 {
+	if (ready_job(idx)) {
+		start_job(idx);
+	} else if (jobs[idx].gate >= 0) {
+		close(jobs[idx].gate);
+		jobs[idx].gate = -1;
+	}
+}
+
+/* Write src to dst as a single-quoted shell word. Returns the end of the word. */
+static char *
+quote_word(char *dst, const char *src)
+{
+	*dst++ = '\'';
+	for (; *src; ++src) {
+		if (*src == '\'') {
+			memcpy(dst, "'\\''", 4);
+			dst += 4;
+		} else {
+			*dst++ = *src;
+		}
+	}
+	*dst++ = '\'';
+	return dst;
+}
+
+/* Execute several jobs of the same batch group within a single shell.
+ * Each job runs in its own subshell, so that a cd, exit or exec only affects the job itself,
+ * and reports its exit status to the status file on file descriptor 3
+ * as a line of the form 'slot status'. */
+static void
+run_batch(int members[], int num)
+{
+	char template[] = TEMPFILE;
+	char *cur;
 	pid_t pid;
+	int fd, i, idx;
 
-	/* Only execute the job if it isn't currently running. */
-	if (jobs[idx].pid) {
-		syslog(LOG_WARNING, "Job #%d won't be executed since it is still running.", jobs[idx].lineno);
+	if ((fd = mkstemp(template)) < 0) {
+		syslog(LOG_EMERG, "Cannot create a status file: %m");
+		return;
+	}
+	unlink(template);
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	fcntl(fd, F_SETFL, O_APPEND);
+
+	cur = script;
+	for (i = 0; i < num; ++i) {
+		idx = members[i];
+		/* Leave out the jobs whose commands can't be loaded. */
+		if (load_command(idx) < 0) {
+			members[i--] = members[--num];
+			continue;
+		}
+		/* Each command is parsed on its own, so that a syntax error only fails its own job. */
+		cur += sprintf(cur, jobs[idx].background ? "{ (eval " : "(eval ");
+		cur = quote_word(cur, jobs[idx].command);
+		cur += sprintf(cur, jobs[idx].background ?
+			"\n) 3>&-; echo %d $? >&3; } &\n" : "\n) 3>&-; echo %d $? >&3\n", i);
+		unload_command(idx);
+	}
+	strcpy(cur, BATCH_TRAILER);
+	if (!num) {
+		close(fd);
 		return;
 	}
 
 	switch (pid = fork()) {
 	case -1:
 		syslog(LOG_EMERG, "Cannot start a new process: %m");
+		STATS(0).failed += num;
+		close(fd);
 		return;
 
 	case 0:
-		setpgid(0, 0);
-		execl(SHELL, SHELL, "-c", jobs[idx].command, NULL);
+		/* All members of a batch come from the same crontab. */
+		setup_child(jobs[members[0]].file, -1);
+		if (fd == 3) fcntl(fd, F_SETFD, 0);
+		else if (dup2(fd, 3) < 0) exit(137);
+		execl(SHELL, SHELL, "-c", script, NULL);
 		/* If we reach this line, execl() must have failed. */
 		exit(137);
 
 	default:
-		syslog(LOG_NOTICE, "Executing job #%d with pid %d.", jobs[idx].lineno, pid);
-		jobs[idx].pid = pid;
+		setpgid(pid, pid);
+		++STATS(0).batches;
+		for (i = 0; i < num; ++i) {
+			idx = members[i];
+			count_start(idx);
+			syslog(LOG_NOTICE, "Executing job #%d with pid %d.", jobs[idx].lineno, pid);
+			jobs[idx].pid = pid;
+			touch_job(idx);
+			jobs[idx].statusfd = fd;
+			jobs[idx].slot = i;
+			if (URGENT(jobs[idx])) ++numUrgent;
+		}
+		/* A batch that starts while urgent jobs run has to wait for them, too. */
+		if (numUrgent) pause_jobs();
 		return;
 	}
 }
 
+/* Collect the exit statuses of all jobs that ran in a batch. */
+static void
+reap_batch(pid_t pid, int fd)
+{
+	char buf[512];
+	ssize_t len, i;
+	off_t off = 0;
+	int idx, slot = 0, status = 0, field = 0;
+
+	for (idx = 0; idx < numJobs; ++idx) batch[idx] = -1;
+
+	/* Parse the 'slot status' lines of the status file. */
+	while ((len = pread(fd, buf, sizeof(buf), off)) > 0) {
+		off += len;
+		for (i = 0; i < len; ++i) {
+			if (isdigit(buf[i])) {
+				if (field) status = status * 10 + buf[i] - '0';
+				else slot = slot * 10 + buf[i] - '0';
+			} else if (buf[i] == ' ') {
+				field = 1;
+			} else if (buf[i] == '\n') {
+				if (slot < numJobs) batch[slot] = status;
+				slot = status = field = 0;
+			}
+		}
+	}
+	close(fd);
+
+	for (idx = 0; idx < numJobs; ++idx) {
+		if (jobs[idx].pid != pid) continue;
+		status = batch[jobs[idx].slot];
+		if (status < 0) {
+			syslog(LOG_WARNING, "Job #%d didn't report its status.", jobs[idx].lineno);
+		} else {
+			syslog(LOG_NOTICE, "Job #%d returned with status %d.", jobs[idx].lineno, status);
+		}
+		if (status == 0) jobs[idx].done = jobs[idx].seen;
+		jobs[idx].pid = 0;
+		touch_job(idx);
+		jobs[idx].statusfd = -1;
+		jobs[idx].paused = 0;
+		if (URGENT(jobs[idx])) urgent_exited();
+	}
+}
+
+/* The order in which jobs that come due together are started: by priority,
+ * then the longest expected runtime first, so that short jobs fill in behind
+ * long ones, and finally in crontab order. */
+static int
+compare_jobs(const void *a, const void *b)
+{
+	const struct Job *x = &jobs[*(const int *) a], *y = &jobs[*(const int *) b];
+
+	if (x->priority != y->priority) return y->priority - x->priority;
+	if (x->runtime != y->runtime) return x->runtime < y->runtime ? 1 : -1;
+	if (x->file != y->file) return x->file - y->file;
+	return x->lineno - y->lineno;
+}
+
+/* Collect the jobs from the queue that are due at the time now into dueJobs,
+ * in ascending order. Only the shards whose closest job needs attention
+ * can hold any. Lazy jobs that turn out to be unschedulable are collected, too,
+ * so that they get removed. Returns how many jobs were collected. */
+static int
+take_due_jobs(time_t now)
+{
+	int shard, idx, end, num = 0;
+
+	for (shard = 0; shard < (SHARDS); ++shard) {
+		if (shardDirty[shard]) scan_shard(shard);
+		if (shardNext[shard] < 0 || wake_time(shardNext[shard]) > now) continue;
+		end = MIN((shard + 1) * shardLen, numJobs);
+		for (idx = shard * shardLen; idx < end; ++idx) {
+			if (jobs[idx].frequent || due_time(idx) > now) continue;
+			/* A lower bound that ties with the front doesn't make a job due yet. */
+			if (jobs[idx].lazy) {
+				resolve_job(idx);
+				if (jobs[idx].time != NEVER && due_time(idx) > now) continue;
+			}
+			dueJobs[num++] = idx;
+		}
+	}
+	return num;
+}
+
+/* Run all jobs that are due at the time now as one dispatch batch.
+ * Due jobs that belong to the same batch group share a single shell.
+ * queued tells whether any of them are due from the queue,
+ * which is the only case in which the queue has to be searched.
+ * Returns NEVER, or the time from which the jobs have to be restarted
+ * after reloading the crontabs, because one of them changed. */
+static time_t
+dispatch(time_t now, int queued)
+{
+	struct tm tm;
+	time_t later;
+	int num = 0, numDue, first, last, idx, i, tmp;
+
+	numDue = queued ? take_due_jobs(now) : 0;
+	for (i = 0; i < numDue; ++i) {
+		if (jobs[dueJobs[i]].time != NEVER) batch[num++] = dueJobs[i];
+	}
+	/* After a jump forward, executions of a job may have piled up on the agenda.
+	 * Just like a job from the queue, it only comes due once, with the first of them. */
+	for (; agendaNext < agendaLen && agenda[agendaNext].due <= now; ++agendaNext) {
+		idx = agenda[agendaNext].job;
+		if (jobs[idx].picked) continue;
+		jobs[idx].picked = 1;
+		jobs[idx].time = agenda[agendaNext].due - jobs[idx].delay;
+		batch[num++] = idx;
+	}
+	sort_in_place(batch, num, sizeof(batch[0]), compare_jobs);
+
+	/* Users may edit their crontabs at any time. Nothing has been started yet,
+	 * so all of the due jobs can come due again from the reloaded crontabs. */
+	for (i = 0; i < num; ++i) {
+		if (!crontab_changed(jobs[batch[i]].file, now)) continue;
+		syslog(LOG_NOTICE, "Reloading the crontabs because %s changed.", crontabs[jobs[batch[i]].file].path);
+		later = now;
+		for (i = 0; i < num; ++i) later = MIN(later, jobs[batch[i]].time);
+		return later - 1;
+	}
+
+	for (i = first = 0; i < num; ++i) {
+		idx = batch[i];
+		jobs[idx].picked = 0;
+		if (now - jobs[idx].time > (CATCHUP_LIMIT) * 60) {
+			syslog(LOG_NOTICE, "Job #%d had to be skipped because it was too far "
+				"in the past. (Was the system time set forward?)", jobs[idx].lineno);
+			++STATS(0).late;
+			/* Closing the gate makes a pre-spawned process exit without executing. */
+			if (jobs[idx].gate >= 0) {
+				close(jobs[idx].gate);
+				jobs[idx].gate = -1;
+			}
+			continue;
+		}
+		batch[first++] = idx;
+	}
+	num = first;
+
+	for (first = 0; first < num; first = last) {
+		last = first + 1;
+		idx = batch[first];
+		if (idx < 0) continue;
+		if (!BATCHABLE(jobs[idx])) {
+			run_job(idx);
+			continue;
+		}
+		if (!ready_job(idx)) continue;
+
+		/* Gather the rest of the job's group, keeping the members in order. */
+		for (i = last; i < num; ++i) {
+			if (batch[i] < 0 || !BATCHABLE(jobs[batch[i]])) continue;
+			if (jobs[batch[i]].group != jobs[idx].group || jobs[batch[i]].file != jobs[idx].file) continue;
+			if (!ready_job(batch[i])) {
+				batch[i] = -1;
+				continue;
+			}
+			tmp = batch[i];
+			memmove(batch + last + 1, batch + last, (i - last) * sizeof(batch[0]));
+			batch[last++] = tmp;
+		}
+		if (last - first > 1) {
+			run_batch(batch + first, last - first);
+		} else {
+			start_job(batch[first]);
+		}
+	}
+
+	/* Schedule the next execution of all jobs that came due from the queue.
+	 * remove_job() moves the last job into idx, so we have to go backwards. */
+	later = current_time();
+	localtime_r(&later, &tm);
+	for (i = numDue - 1; i >= 0; --i) {
+		idx = dueJobs[i];
+		/* Jobs that just turned out to be unschedulable while being resolved have been logged already. */
+		if (jobs[idx].time != NEVER) {
+			/* A failed pre-spawn only falls back to a regular start once. */
+			if (jobs[idx].prespawn) jobs[idx].prespawn = PRESPAWN_WANTED;
+			update_job(idx, &tm);
+			++STATS(0).scheduled;
+		}
+		if (jobs[idx].time == NEVER) remove_job(idx);
+	}
+	fill_agenda(later);
+	return NEVER;
+}
+
 /* Reap (and log) any zombie childs that have piled up since the last reap. */
 static void
 reap_zombies(void)
@@ -488,21 +2571,403 @@ reap_zombies(void)
 		/* Allow the returning job to be ran again.
 		 * It's not a problem if we don't find a corresponding job. */
 		for (idx = 0; idx < numJobs; ++idx) {
+			if (jobs[idx].pid == pid && jobs[idx].statusfd >= 0) {
+				reap_batch(pid, jobs[idx].statusfd);
+				break;
+			}
 			if (jobs[idx].pid == pid) {
 				jobs[idx].pid = 0;
+				jobs[idx].paused = 0;
+				touch_job(idx);
+				/* A pre-spawned process that died at its gate would otherwise be spawned again right away. */
+				if (jobs[idx].gate >= 0) {
+					syslog(LOG_WARNING, "Pre-spawned job #%d exited before it came due.", jobs[idx].lineno);
+					close(jobs[idx].gate);
+					jobs[idx].gate = -1;
+					jobs[idx].prespawn = PRESPAWN_FAILED;
+				}
+				/* Jobs in a batch share their pid, so we only learn the runtime of jobs started on their own. */
+				if (jobs[idx].started) {
+					if (jobs[idx].runtime) {
+						jobs[idx].runtime += (current_time() - jobs[idx].started - jobs[idx].runtime) / 4;
+					} else {
+						jobs[idx].runtime = current_time() - jobs[idx].started;
+					}
+					jobs[idx].started = 0;
+					if (URGENT(jobs[idx])) urgent_exited();
+					/* A pre-spawned process that was never let through its gate ran nothing. */
+					if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+						jobs[idx].done = jobs[idx].seen;
+					}
+				}
 				break;
 			}
 		}
 	}
 }
 
+static double
+seconds_between(const struct timespec *a, const struct timespec *b)
+{
+	return (b->tv_sec - a->tv_sec) + (b->tv_nsec - a->tv_nsec) / 1e9;
+}
+
+/* Publish that the main loop moves on to another phase, and account for the one it leaves. */
+static void
+enter_phase(int next)
+{
+	struct timespec now;
+	double len;
+
+	if (!STALL_THRESHOLD) return;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	pthread_mutex_lock(&watchLock);
+	len = seconds_between(&phaseBegin, &now);
+	if (phase != PHASE_WAITING && len >= STALL_THRESHOLD) {
+		++stalls[phase];
+		longestStall[phase] = MAX(longestStall[phase], len);
+	}
+	phase = next;
+	phaseBegin = now;
+	++beat;
+	pthread_mutex_unlock(&watchLock);
+}
+
+/* Log a warning from the watchdog. The main loop may be stuck inside syslog(3),
+ * holding the lock that guards glibc's connection to the logger, so the watchdog
+ * talks to the logger's socket by itself. Rather than blocking on a logger that
+ * doesn't keep up, it falls back to stderr. */
+static void
+watch_log(const char *fmt, ...)
+{
+	struct sockaddr_un addr;
+	struct tm tm;
+	time_t now;
+	va_list ap;
+	char buf[512];
+	int len, head;
+
+	now = time(NULL);
+	localtime_r(&now, &tm);
+	len = snprintf(buf, sizeof(buf), "<%d>", LOG_CRON | LOG_WARNING);
+	len += strftime(buf + len, sizeof(buf) - len, "%b %e %H:%M:%S ", &tm);
+	head = len;
+	len += snprintf(buf + len, sizeof(buf) - len, "%s[%d]: ", LOGIDENT, (int) getpid());
+	va_start(ap, fmt);
+	vsnprintf(buf + len, sizeof(buf) - len, fmt, ap);
+	va_end(ap);
+	len = strlen(buf);
+
+	if (watchSocket < 0 && (watchSocket = socket(AF_UNIX, SOCK_DGRAM, 0)) >= 0) {
+		fcntl(watchSocket, F_SETFD, FD_CLOEXEC);
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		strncpy(addr.sun_path, _PATH_LOG, sizeof(addr.sun_path) - 1);
+		if (connect(watchSocket, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+			close(watchSocket);
+			watchSocket = -1;
+		}
+	}
+	if (watchSocket >= 0 && send(watchSocket, buf, len, MSG_DONTWAIT) == len) return;
+	/* The logger may have gone away. Reconnect next time. */
+	if (watchSocket >= 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+		close(watchSocket);
+		watchSocket = -1;
+	}
+	buf[len++] = '\n';
+	writeall(2, buf + head, len - head);
+}
+
+/* The watchdog thread. It notices when the main loop is stuck in one phase for too long,
+ * and says so while it's still happening, since the main loop itself can't. */
+static void *
+watch_loop(void *arg)
+{
+	struct timespec nap, now, begin, lastLog;
+	unsigned long seen, reported = 0, suppressed = 0;
+	double len;
+	int cur;
+
+	(void) arg;
+	nap.tv_sec = (STALL_THRESHOLD) / 2;
+	nap.tv_nsec = (STALL_THRESHOLD) % 2 * 500000000L;
+	clock_gettime(CLOCK_MONOTONIC, &lastLog);
+	lastLog.tv_sec -= STALL_LOG_PERIOD;
+
+	for (;;) {
+		nanosleep(&nap, NULL);
+
+		pthread_mutex_lock(&watchLock);
+		seen = beat;
+		cur = phase;
+		begin = phaseBegin;
+		pthread_mutex_unlock(&watchLock);
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		len = seconds_between(&begin, &now);
+		if (cur == PHASE_WAITING || seen == reported || len < STALL_THRESHOLD) continue;
+
+		reported = seen;
+		if (seconds_between(&lastLog, &now) < STALL_LOG_PERIOD) {
+			++suppressed;
+			continue;
+		}
+		watch_log("The main loop has been stuck %s for %.1f seconds (%lu more stalls not logged).",
+			phaseNames[cur], len, suppressed);
+		lastLog = now;
+		suppressed = 0;
+	}
+	return NULL;
+}
+
+static void
+start_watchdog(void)
+{
+	pthread_t thread;
+	int err;
+
+	enter_phase(PHASE_RELOADING);
+	if (!STALL_THRESHOLD) return;
+	if ((err = start_thread(&thread, watch_loop, NULL))) {
+		syslog(LOG_WARNING, "Can't start the watchdog: %s", strerror(err));
+		return;
+	}
+	pthread_detach(thread);
+}
+
+/* Log how the daemon has been doing. */
+static void
+dump_state(void)
+{
+	struct Stats sum;
+	char buf[LATENCY_BUCKETS * 24];
+	size_t len = 0;
+	int slot, i, p;
+
+	memset(&sum, 0, sizeof(sum));
+	for (slot = 0; slot < (SHARDS); ++slot) {
+		sum.started += STATS(slot).started;
+		sum.batches += STATS(slot).batches;
+		sum.prespawned += STATS(slot).prespawned;
+		sum.failed += STATS(slot).failed;
+		sum.late += STATS(slot).late;
+		sum.running += STATS(slot).running;
+		sum.unchanged += STATS(slot).unchanged;
+		sum.claimed += STATS(slot).claimed;
+		sum.scheduled += STATS(slot).scheduled;
+		sum.paused += STATS(slot).paused;
+		for (i = 0; i < LATENCY_BUCKETS; ++i) {
+			sum.latency[i] += STATS(slot).latency[i];
+		}
+	}
+
+	syslog(LOG_NOTICE, "Started %lu jobs (%lu batches, %lu pre-spawned), and failed to start %lu.",
+		sum.started, sum.batches, sum.prespawned, sum.failed);
+	syslog(LOG_NOTICE, "Skipped %lu jobs that were too late, %lu still running, %lu with unchanged inputs, "
+		"and %lu run by another instance.", sum.late, sum.running, sum.unchanged, sum.claimed);
+	syslog(LOG_NOTICE, "Scheduled %lu job executions, and paused %lu processes for urgent jobs.",
+		sum.scheduled, sum.paused);
+
+	buf[0] = 0;
+	for (i = 0; i < LATENCY_BUCKETS; ++i) {
+		if (!sum.latency[i]) continue;
+		len += snprintf(buf + len, sizeof(buf) - len, " %s%ldms: %lu,",
+			i == LATENCY_BUCKETS - 1 ? ">=" : "<", 1L << (i == LATENCY_BUCKETS - 1 ? i - 1 : i), sum.latency[i]);
+	}
+	if (len) buf[len - 1] = 0;
+	syslog(LOG_NOTICE, "Start latencies:%s", len ? buf : " none yet");
+
+	for (p = PHASE_DISPATCHING; p < NUM_PHASES; ++p) {
+		syslog(LOG_NOTICE, "The main loop stalled %lu times while %s, for at most %.1f seconds.",
+			stalls[p], phaseNames[p], longestStall[p]);
+	}
+}
+
+/* Apply advice to all the pages that lie entirely within a buffer. */
+static void
+advise_pages(void *buf, size_t size, int advice)
+{
+	uintptr_t page, begin, end;
+
+	page = sysconf(_SC_PAGESIZE);
+	begin = ((uintptr_t) buf + page - 1) & ~(page - 1);
+	end = ((uintptr_t) buf + size) & ~(page - 1);
+	if (end > begin) madvise((void *) begin, end - begin, advice);
+}
+
+/* Hand the memory we won't need for a while back to the system before a long sleep.
+ * The scratch buffers don't hold anything between dispatches, so their pages can
+ * simply be dropped; the kernel hands out fresh ones once they are used again. */
+static void
+trim_memory(void)
+{
+	if (batch) advise_pages(batch, (numJobs + 1) * sizeof(batch[0]), MADV_DONTNEED);
+	if (script) advise_pages(script, scriptSize, MADV_DONTNEED);
+	if (cmdbuf) advise_pages(cmdbuf, cmdbufSize, MADV_DONTNEED);
+#ifdef MADV_COLD
+	/* The jobs are still needed, but are the first thing that should go if memory runs low. */
+	if (jobs) advise_pages(jobs, capJobs * sizeof(jobs[0]), MADV_COLD);
+#endif
+#ifdef __GLIBC__
+	malloc_trim(0);
+#endif
+}
+
+/* Grow the stack by RT_STACK bytes now, rather than when a job comes due.
+ * The array has to live in a frame of its own, below that of main(), where the
+ * dispatch loop's calls will reuse it, so this must not be inlined. */
+static NOINLINE void
+prefault_stack(void)
+{
+	volatile char stack[RT_STACK];
+	size_t i;
+
+	for (i = 0; i < sizeof(stack); ++i) stack[i] = 0;
+}
+
+/* Give the dispatch loop real-time priority, and make sure it never has to wait for a page fault.
+ * Everything it needs has been allocated by load_jobs(), so locking it all in memory is enough. */
+static void
+enter_realtime(void)
+{
+	struct sched_param param;
+
+	memset(&param, 0, sizeof(param));
+	param.sched_priority = RT_PRIORITY;
+	if (sched_setscheduler(0, SCHED_FIFO, &param) < 0) {
+		syslog(LOG_WARNING, "Can't use SCHED_FIFO, falling back to a nice value of %d: %m", RT_NICE);
+		if (setpriority(PRIO_PROCESS, 0, RT_NICE) < 0) {
+			syslog(LOG_WARNING, "Can't raise the priority: %m");
+		}
+	}
+
+#ifdef __GLIBC__
+	/* Keep freed memory (like syslog()'s buffers) around instead of handing it back to the kernel. */
+	mallopt(M_TRIM_THRESHOLD, -1);
+	mallopt(M_MMAP_MAX, 0);
+#endif
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+		syslog(LOG_WARNING, "Can't lock ocrond into memory: %m");
+	}
+	prefault_stack();
+}
+
+/* Print what the daemon makes of each job: its normalized schedule,
+ * how often it fires, how much work it is to schedule, and how it gets executed. */
+static void
+explain_jobs(void)
+{
+	struct tm tm;
+	time_t now;
+	unsigned long long minutes;
+	unsigned long hours;
+	long perDay, perYear;
+	int idx, year, days, lookahead, worst;
+
+	now = current_time();
+	localtime_r(&now, &tm);
+	year = tm.tm_year;
+	days = is_leap_year(1900 + year) ? 366 : 365;
+	/* update_job() marks the shard of each job it touches. */
+	shardLen = MAX(numJobs, 1);
+
+	for (idx = 0; idx < numJobs; ++idx) {
+		if (load_command(idx) < 0) continue;
+		printf("%s:%d: %s\n", crontabs[jobs[idx].file].path, jobs[idx].lineno, jobs[idx].command);
+		/* Wildcards set all bits, so only show the ones that mean something. */
+		minutes = jobs[idx].minutes & ((1ULL << 60) - 1);
+		hours = jobs[idx].hours & ((1UL << 24) - 1);
+		printf("\tminutes %015llx hours %06lx mdays %08lx wmdays %08lx nthwdays %011llx months %03x wdays %02x\n",
+			minutes, hours, jobs[idx].mdays & 0xffffffffUL, jobs[idx].wmdays & 0xffffffffUL,
+			jobs[idx].nthwdays & ((1ULL << 7 * (LAST_NTH + 1)) - 1),
+			jobs[idx].months & 0xfffU, jobs[idx].wdays & 0x7fU);
+
+		/* Walk through the year day by day on which the job fires,
+		 * starting from the last minute of the year before. */
+		perDay = count_bits(minutes) * count_bits(hours);
+		memset(&tm, 0, sizeof(tm));
+		tm.tm_year = year - 1;
+		tm.tm_mon = 11;
+		tm.tm_mday = 31;
+		tm.tm_hour = 23;
+		tm.tm_min = 59;
+		tm.tm_isdst = -1;
+		mktime(&tm);
+		perYear = worst = 0;
+		for (;;) {
+			lookahead = update_job(idx, &tm);
+			worst = MAX(worst, lookahead);
+			if (jobs[idx].time == NEVER) break;
+			localtime_r(&jobs[idx].time, &tm);
+			if (tm.tm_year != year) break;
+			perYear += perDay;
+			tm.tm_hour = 23;
+			tm.tm_min = 59;
+		}
+
+		if (jobs[idx].time == NEVER && !perYear) {
+			printf("\tfires never; lookahead gives up after %d days\n", worst);
+		} else {
+			printf("\tfires %ld times on each day it fires, %.1f per week, %ld in %d; lookahead at most %d days\n",
+				perDay, perYear * 7.0 / days, perYear, 1900 + year, worst);
+		}
+		if (jobs[idx].frequent) {
+			printf("\tscheduled through the agenda\n");
+		}
+		if (BATCHABLE(jobs[idx])) {
+			printf("\texecuted by the shell of its batch group\n");
+		} else if (plain_command(jobs[idx].command)) {
+			printf("\texecuted directly\n");
+		} else {
+			printf("\texecuted by %s\n", SHELL);
+		}
+		unload_command(idx);
+	}
+}
+
+static void
+usage(void)
+{
+	fputs("usage: ocrond [-x] [-R] [-L lockdir [-S k/n]]\n", stderr);
+	exit(EXIT_FAILURE);
+}
+
 int
-main()
+main(int argc, char *argv[])
 {
-	sigset_t signalMask;
-	struct timespec spec;
-	time_t begin;
-	int i, next, sig;
+	sigset_t signalMask, pipeMask;
+	struct timespec spec, now;
+	time_t begin, wake, from = NEVER;
+	int next, sig, opt, explain = 0;
+
+	while ((opt = getopt(argc, argv, "L:RS:x")) != -1) {
+		switch (opt) {
+		case 'L':
+			lockDir = optarg;
+			break;
+		case 'R':
+			realtime = 1;
+			break;
+		case 'x':
+			explain = 1;
+			break;
+		case 'S':
+			if (sscanf(optarg, "%u/%u", &instance, &numInstances) != 2) usage();
+			if (!numInstances || instance >= numInstances) usage();
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind < argc || (numInstances > 1 && !lockDir)) usage();
+
+	if (explain) {
+		openlog(LOGIDENT, LOG_PERROR, LOG_CRON);
+		load_jobs();
+		explain_jobs();
+		free_jobs();
+		return 0;
+	}
 
 	sigemptyset(&signalMask);
 	sigaddset(&signalMask, SIGCHLD);
@@ -510,31 +2975,71 @@ main()
 	sigaddset(&signalMask, SIGTERM);
 	sigaddset(&signalMask, SIGINT);
 	sigaddset(&signalMask, SIGQUIT);
+	sigaddset(&signalMask, SIGUSR1);
 
 	sigprocmask(SIG_BLOCK, &signalMask, NULL);
-
-	openlog(LOGIDENT, LOG_CONS, LOG_CRON);
+	/* Releasing a pre-spawned job that just died has to fail with EPIPE instead of killing us.
+	 * Children start with an empty signal mask, see setup_child(). */
+	sigemptyset(&pipeMask);
+	sigaddset(&pipeMask, SIGPIPE);
+	sigprocmask(SIG_BLOCK, &pipeMask, NULL);
+
+	/* In real-time mode, connect to the system log and load the time zone right away. */
+	openlog(LOGIDENT, realtime ? LOG_CONS | LOG_NDELAY : LOG_CONS, LOG_CRON);
+	if (realtime) tzset();
 	syslog(LOG_NOTICE, "ocron %s starting up with pid %d.", VERSION, getpid());
 
-	if (!(access(CRONTAB, F_OK) < 0)) {
-		parse_file(CRONTAB);
+	if (lockDir && access(lockDir, W_OK) < 0) {
+		die("Can't use %s as the lock directory: %m", lockDir);
+	}
+
+	if (posix_memalign((void **) &stats, CACHELINE, (SHARDS) * sizeof(stats[0]))) {
+		die("Out of memory.");
 	}
+	memset(stats, 0, (SHARDS) * sizeof(stats[0]));
+
+	/* The watchdog inherits our signal mask, so it never receives any signals. */
+	start_watchdog();
+
+	load_jobs();
+	if (realtime) enter_realtime();
 
 restart:
-	begin = time(NULL);
-	for (i = numJobs - 1; i >= 0; --i) update_job(i, begin);
-	next = closest_job();
+	restart_jobs(from != NEVER ? from : current_time());
+	from = NEVER;
+	next = next_job();
 
 	for (;;) {
-		begin = time(NULL);
+		enter_phase(PHASE_WAITING);
+		clock_gettime(CLOCK_REALTIME, &now);
+		begin = now.tv_sec;
+
+		wake = agenda_wake();
+		if (next >= 0 && (wake == NEVER || wake_time(next) < wake)) wake = wake_time(next);
 
-		if (next < 0) {
+		if (wake == NEVER) {
+			if (IDLE_TRIM && !realtime) trim_memory();
 			sig = sigwaitinfo(&signalMask, NULL);
 		} else {
-			if (jobs[next].time > begin) {
-				spec.tv_sec = MIN(jobs[next].time - begin, (WAKEUP_PERIOD) * 60);
-				spec.tv_nsec = 0L;
+			if (wake > begin) {
+				/* Sleep until the exact second boundary, so that jobs start on time. */
+				if (wake - begin > (WAKEUP_PERIOD) * 60) {
+					spec.tv_sec = (WAKEUP_PERIOD) * 60;
+					spec.tv_nsec = 0L;
+				} else if (now.tv_nsec) {
+					spec.tv_sec = wake - begin - 1;
+					spec.tv_nsec = 1000000000L - now.tv_nsec;
+				} else {
+					spec.tv_sec = wake - begin;
+					spec.tv_nsec = 0L;
+				}
+				/* Locked memory can't be trimmed. */
+				if (IDLE_TRIM && !realtime && spec.tv_sec >= (IDLE_TRIM) * 60) {
+					trim_memory();
+				}
 				sig = sigtimedwait(&signalMask, NULL, &spec);
+			} else if (next >= 0 && wake == wake_time(next) && wake < due_time(next)) {
+				sig = PRESPAWNREACHED;
 			} else {
 				sig = JOBREACHED;
 			}
@@ -542,26 +3047,34 @@ restart:
 
 		switch (sig) {
 		case JOBREACHED:
-			if (begin - jobs[next].time <= (CATCHUP_LIMIT) * 60) {
-				run_job(next);
-			} else {
-				syslog(LOG_NOTICE, "Job #%d had to be skipped because it was too far "
-					"in the past. (Was the system time set forward?)", jobs[next].lineno);
+			enter_phase(PHASE_DISPATCHING);
+			from = dispatch(begin, next >= 0 && due_time(next) <= begin);
+			if (from != NEVER) {
+				enter_phase(PHASE_RELOADING);
+				free_jobs();
+				load_jobs();
+				goto restart;
 			}
-			update_job(next, time(NULL));
-			next = closest_job();
+			next = next_job();
+			break;
+
+		case PRESPAWNREACHED:
+			enter_phase(PHASE_DISPATCHING);
+			prespawn_job(next);
+			next = next_job();
 			break;
 
 		case SIGCHLD:
+			enter_phase(PHASE_REAPING);
 			reap_zombies();
+			next = next_job();
 			break;
 
 		case SIGHUP:
-			syslog(LOG_NOTICE, "Reloading %s because we received a SIGHUP.", CRONTAB);
+			enter_phase(PHASE_RELOADING);
+			syslog(LOG_NOTICE, "Reloading %s because we received a SIGHUP.", crontabPath);
 			free_jobs();
-			if (!(access(CRONTAB, F_OK) < 0)) {
-				parse_file(CRONTAB);
-			}
+			load_jobs();
 			goto restart;
 
 		case SIGTERM:
@@ -572,8 +3085,13 @@ restart:
 			closelog();
 			exit(0);
 
+		case SIGUSR1:
+			dump_state();
+			break;
+
 		case -1:
-			if (time(NULL) < begin) {
+			if (current_time() < begin) {
+				enter_phase(PHASE_RELOADING);
 				syslog(LOG_NOTICE, "Detected that the system time was set back. Recalculating.");
 				goto restart;
 			}